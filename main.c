@@ -1,14 +1,19 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <math.h>
+#include <time.h>
 #include "mpc.h"
 
 #define UNUSED (x) (void) (x)
 #define FOREVER 1
 
 #ifdef _WIN32
-#include <string.h>
 static char buffer[2048];
 
 char *
@@ -36,352 +41,5486 @@ typedef enum
 {
     LVAL_ERR,
     LVAL_INT,
+    LVAL_BIG,
     LVAL_DOUBLE,
     LVAL_SYM,
-    LVAL_SEXPR
+    LVAL_SLOT,
+    LVAL_FUN,
+    LVAL_LAMBDA,
+    LVAL_SEXPR,
+    LVAL_VEC,
+    LVAL_MAT
 } lval_type;
 
-typedef struct lval
+/*
+ * Builtins are resolved from their symbol once, by lval_read. def, if,
+ * lambda and let are special forms that decide themselves which of their
+ * operands get evaluated.
+ */
+typedef enum
+{
+    BUILTIN_ADD,
+    BUILTIN_SUB,
+    BUILTIN_MUL,
+    BUILTIN_DIV,
+    BUILTIN_MOD,
+    BUILTIN_POW,
+    BUILTIN_DEF,
+    BUILTIN_EQ,
+    BUILTIN_NE,
+    BUILTIN_LT,
+    BUILTIN_GT,
+    BUILTIN_LE,
+    BUILTIN_GE,
+    BUILTIN_IF,
+    BUILTIN_LAMBDA,
+    BUILTIN_LET,
+    BUILTIN_SUM,
+    BUILTIN_PROD,
+    BUILTIN_MIN,
+    BUILTIN_MAX,
+    BUILTIN_DOT,
+    BUILTIN_MEAN,
+    BUILTIN_MATRIX,
+    BUILTIN_MATMUL,
+    BUILTIN_AT,
+    BUILTIN_SHAPE,
+    BUILTIN_COUNT
+} lbuiltin;
+
+static const char *builtin_names[BUILTIN_COUNT] =
+{
+    [BUILTIN_ADD] = "+",
+    [BUILTIN_SUB] = "-",
+    [BUILTIN_MUL] = "*",
+    [BUILTIN_DIV] = "/",
+    [BUILTIN_MOD] = "%",
+    [BUILTIN_POW] = "^",
+    [BUILTIN_DEF]    = "def",
+    [BUILTIN_EQ]     = "==",
+    [BUILTIN_NE]     = "!=",
+    [BUILTIN_LT]     = "<",
+    [BUILTIN_GT]     = ">",
+    [BUILTIN_LE]     = "<=",
+    [BUILTIN_GE]     = ">=",
+    [BUILTIN_IF]     = "if",
+    [BUILTIN_LAMBDA] = "lambda",
+    [BUILTIN_LET]    = "let",
+    [BUILTIN_SUM]    = "sum",
+    [BUILTIN_PROD]   = "prod",
+    [BUILTIN_MIN]    = "min",
+    [BUILTIN_MAX]    = "max",
+    [BUILTIN_DOT]    = "dot",
+    [BUILTIN_MEAN]   = "mean",
+    [BUILTIN_MATRIX] = "matrix",
+    [BUILTIN_MATMUL] = "matmul",
+    [BUILTIN_AT]     = "at",
+    [BUILTIN_SHAPE]  = "shape",
+};
+
+/* The arithmetic operators handled by builtin_op */
+static inline bool
+builtin_is_op (lbuiltin f) { return f <= BUILTIN_POW; }
+
+/*
+ * An lval is a single NaN-boxed 64 bit word. Any bit pattern that is not
+ * one of our tagged quiet NaNs is a plain double. Small integers, interned
+ * symbol ids, local variable slots and builtin handles live inline in the
+ * low 48 bits, everything else (sexprs, errors and integers too wide for
+ * the payload) is a pointer to a heap lobj.
+ */
+typedef uint64_t lval;
+
+#define LVAL_BOX        0xFFF8000000000000ull
+#define LVAL_TAG_MASK   0xFFFF000000000000ull
+#define LVAL_PAYLOAD    0x0000FFFFFFFFFFFFull
+#define LVAL_TAG_INT    0xFFF9000000000000ull
+#define LVAL_TAG_SYM    0xFFFA000000000000ull
+#define LVAL_TAG_OBJ    0xFFFB000000000000ull
+#define LVAL_TAG_FUN    0xFFFC000000000000ull
+#define LVAL_TAG_SLOT   0xFFFD000000000000ull
+
+#define LVAL_INT_MIN    (-(1l << 47))
+#define LVAL_INT_MAX    ((1l << 47) - 1)
+
+struct llambda;
+
+typedef struct lobj
+{
+    lval_type type;
+    bool arena; // Lives in the evaluation arena, freed wholesale
+    int refs;   // Holders of a shared object, lambdas always, everything with LISPY_RC
+    union
+    {
+        long inum;  // Integers that do not fit the inline payload
+        struct
+        {
+            int len;
+            bool neg;
+            uint32_t *limb;
+        } big;      // Integers that do not fit a long, see lbig
+        struct
+        {
+            int len;
+            bool real; // Doubles rather than longs
+            union
+            {
+                long *ints;
+                double *reals;
+                void *data;
+            };
+        } vec;
+        struct
+        {
+            int rows;
+            int cols;
+            double *data; // Row-major
+        } mat;
+        char *err;
+        struct llambda *fn;
+        struct
+        {
+            int count; // For the length of lval list
+            int cap;   // Slots allocated in cell
+            lval *cell;
+        };
+    };
+} lobj;
+
+static inline bool
+lval_is_obj (lval v) { return (v & LVAL_TAG_MASK) == LVAL_TAG_OBJ; }
+
+static inline lobj *
+lval_obj (lval v) { return (lobj *) (uintptr_t) (v & LVAL_PAYLOAD); }
+
+static inline lval
+lval_box (lobj *o) { return LVAL_TAG_OBJ | (uint64_t) (uintptr_t) o; }
+
+static inline bool
+lval_is_fixnum (lval v) { return (v & LVAL_TAG_MASK) == LVAL_TAG_INT; }
+
+static inline bool
+lval_is_double (lval v) { return (v & LVAL_BOX) != LVAL_BOX || (v & LVAL_TAG_MASK) == LVAL_BOX; }
+
+lval_type
+lval_type_of (lval v)
+{
+    /* Real doubles, including the NaNs the FPU hands back */
+    if (lval_is_double (v)) return LVAL_DOUBLE;
+
+    switch (v & LVAL_TAG_MASK)
+    {
+    case LVAL_TAG_INT : return LVAL_INT;
+    case LVAL_TAG_SYM : return LVAL_SYM;
+    case LVAL_TAG_FUN : return LVAL_FUN;
+    case LVAL_TAG_SLOT: return LVAL_SLOT;
+    default           : return lval_obj (v)->type;
+    }
+}
+
+/* Sign extends the 48 bit payload, with ops plain SSE2 has lanes for */
+static inline long
+lval_as_fixnum (lval v)
+{
+    const uint64_t sign = 1ull << 47;
+    return (long) (((v & LVAL_PAYLOAD) ^ sign) - sign);
+}
+
+static inline long
+lval_as_int (lval v)
+{
+    if (lval_is_obj (v)) return lval_obj (v)->inum;
+    return lval_as_fixnum (v);
+}
+
+static inline lbuiltin
+lval_as_fun (lval v) { return (lbuiltin) (v & LVAL_PAYLOAD); }
+
+static inline double
+lval_as_double (lval v)
+{
+    double d;
+    memcpy (&d, &v, sizeof (d));
+    return d;
+}
+
+/*
+ * Every distinct symbol name is stored once in the atom table and a
+ * symbol lval just carries its atom id, so comparing two symbols is
+ * comparing two words. Ids index "atoms" and the open-addressed "slots"
+ * map hashes to ids + 1 (0 marks an empty slot).
+ */
+typedef struct latom
+{
+    char *name;
+    size_t len;
+    uint64_t hash;
+} latom;
+
+static struct
+{
+    latom *atoms;
+    int count;
+    int cap;
+    int *slots;
+    int nslots; // Always a power of two
+} lval_atoms;
+
+static inline uint64_t
+latom_hash (const char *s, size_t len)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) s[i]) * 0x100000001b3ull;
+    return h;
+}
+
+void
+latom_rehash (int nslots)
+{
+    free (lval_atoms.slots);
+    lval_atoms.slots = calloc (nslots, sizeof (int));
+    lval_atoms.nslots = nslots;
+
+    /* Hashes were kept, so this is just reinserting the ids */
+    for (int id = 0; id < lval_atoms.count; id++)
+    {
+        size_t i = lval_atoms.atoms[id].hash & (nslots - 1);
+        while (lval_atoms.slots[i] != 0) i = (i + 1) & (nslots - 1);
+        lval_atoms.slots[i] = id + 1;
+    }
+}
+
+int
+latom_intern (const char *name)
+{
+    size_t len = strlen (name);
+    uint64_t hash = latom_hash (name, len);
+
+    if (lval_atoms.nslots == 0) latom_rehash (64);
+
+    size_t i = hash & (lval_atoms.nslots - 1);
+    for (; lval_atoms.slots[i] != 0; i = (i + 1) & (lval_atoms.nslots - 1))
+    {
+        latom *a = &lval_atoms.atoms[lval_atoms.slots[i] - 1];
+        if (a->hash == hash && a->len == len && memcmp (a->name, name, len) == 0)
+            return lval_atoms.slots[i] - 1;
+    }
+
+    if (lval_atoms.count == lval_atoms.cap)
+    {
+        lval_atoms.cap = lval_atoms.cap ? lval_atoms.cap * 2 : 64;
+        lval_atoms.atoms = realloc (lval_atoms.atoms, sizeof (latom) * lval_atoms.cap);
+    }
+
+    int id = lval_atoms.count++;
+    latom *a = &lval_atoms.atoms[id];
+    a->name = malloc (len + 1);
+    memcpy (a->name, name, len + 1);
+    a->len = len;
+    a->hash = hash;
+    lval_atoms.slots[i] = id + 1;
+
+    /* Keep the load factor under a half */
+    if (lval_atoms.count * 2 > lval_atoms.nslots) latom_rehash (lval_atoms.nslots * 2);
+
+    return id;
+}
+
+void
+latom_init (void)
+{
+    /* Builtin names go in first so their atom id is their lbuiltin */
+    for (int op = 0; op < BUILTIN_COUNT; op++)
+        latom_intern (builtin_names[op]);
+}
+
+void
+latom_cleanup (void)
+{
+    for (int id = 0; id < lval_atoms.count; id++)
+        free (lval_atoms.atoms[id].name);
+
+    free (lval_atoms.atoms);
+    free (lval_atoms.slots);
+}
+
+static inline int
+lval_as_atom (lval v) { return (int) (v & LVAL_PAYLOAD); }
+
+static inline const char *
+lval_sym_name (lval v) { return lval_atoms.atoms[lval_as_atom (v)].name; }
+
+/*
+ * A local variable reference, resolved by lval_resolve from a symbol to
+ * the frame "depth" scopes out and the value at "index" in it. The
+ * symbol's atom is kept in the low bits for printing.
+ */
+static inline lval
+lval_slot (int depth, int index, int atom)
+{
+    return LVAL_TAG_SLOT | (uint64_t) depth << 40 | (uint64_t) index << 24 | (uint64_t) atom;
+}
+
+static inline int
+lval_slot_depth (lval v) { return (int) ((v >> 40) & 0xFF); }
+
+static inline int
+lval_slot_index (lval v) { return (int) ((v >> 24) & 0xFFFF); }
+
+static inline int
+lval_slot_atom (lval v) { return (int) (v & 0xFFFFFF); }
+
+/*
+ * Bump allocator for everything a single top-level evaluation creates.
+ * Memory is carved out of chunks and never freed individually, instead
+ * the whole arena is rewound once the result has been printed.
+ */
+#define LARENA_CHUNK (64 * 1024)
+#define LARENA_ALIGN 16
+
+typedef struct lchunk
+{
+    struct lchunk *next;
+    size_t size;
+    size_t used;
+    _Alignas (LARENA_ALIGN) char data[];
+} lchunk;
+
+typedef struct larena
+{
+    lchunk *first;
+    lchunk *cur;
+    char *last; // Most recent allocation, which can grow in place
+    size_t allocated; // Bytes handed out by larena_alloc, never rewound
+} larena;
+
+/* Where new lobjs come from, NULL outside of an evaluation */
+static larena *lval_arena = NULL;
+
+void *
+larena_alloc (larena *a, size_t size)
+{
+    size = (size + LARENA_ALIGN - 1) & ~(size_t) (LARENA_ALIGN - 1);
+
+    /* Move along to a chunk with enough room, reusing ones kept by larena_reset */
+    while (a->cur == NULL || a->cur->used + size > a->cur->size)
+    {
+        if (a->cur != NULL && a->cur->next != NULL)
+        {
+            a->cur = a->cur->next;
+            a->cur->used = 0;
+            continue;
+        }
+
+        size_t csize = size > LARENA_CHUNK ? size : LARENA_CHUNK;
+        lchunk *c = malloc (sizeof (lchunk) + csize);
+        c->next = NULL;
+        c->size = csize;
+        c->used = 0;
+
+        if (a->cur == NULL) a->first = c;
+        else a->cur->next = c;
+        a->cur = c;
+    }
+
+    a->last = a->cur->data + a->cur->used;
+    a->cur->used += size;
+    a->allocated += size;
+    return a->last;
+}
+
+void *
+larena_grow (larena *a, void *p, size_t old, size_t size)
+{
+    size_t aligned = (size + LARENA_ALIGN - 1) & ~(size_t) (LARENA_ALIGN - 1);
+
+    /* The newest allocation can simply be extended */
+    if (p != NULL && p == a->last
+        && (char *) p + aligned <= a->cur->data + a->cur->size)
+    {
+        a->cur->used = (char *) p - a->cur->data + aligned;
+        return p;
+    }
+
+    /* Shrinking elsewhere isn't worth a copy, the space comes back on reset */
+    if (size <= old) return p;
+
+    void *n = larena_alloc (a, size);
+    if (p != NULL) memcpy (n, p, old < size ? old : size);
+    return n;
+}
+
+/* A point in the arena that can be rewound to, dropping everything after it */
+typedef struct lmark
+{
+    lchunk *chunk;
+    size_t used;
+} lmark;
+
+lmark
+larena_mark (larena *a)
+{
+    return (lmark) { a->cur, a->cur ? a->cur->used : 0 };
+}
+
+void
+larena_rewind (larena *a, lmark m)
+{
+    /* Chunks past the mark are cleared as larena_alloc moves onto them */
+    a->cur = m.chunk ? m.chunk : a->first;
+    if (a->cur != NULL) a->cur->used = m.used;
+    a->last = NULL;
+}
+
+void
+larena_reset (larena *a)
+{
+    /* Keep the standard sized chunks around for the next evaluation */
+    lchunk **link = &a->first;
+    while (*link != NULL)
+    {
+        lchunk *c = *link;
+        if (c->size > LARENA_CHUNK)
+        {
+            *link = c->next;
+            free (c);
+            continue;
+        }
+        c->used = 0;
+        link = &c->next;
+    }
+
+    a->cur = a->first;
+    a->last = NULL;
+}
+
+void
+larena_free (larena *a)
+{
+    while (a->first != NULL)
+    {
+        lchunk *next = a->first->next;
+        free (a->first);
+        a->first = next;
+    }
+    a->cur = NULL;
+    a->last = NULL;
+}
+
+/*
+ * Slab pool for memory that outlives an evaluation. Requests are rounded
+ * up to a power of two size class, each class keeps a per-thread free
+ * list, and empty lists are refilled by carving up a fresh slab. Anything
+ * larger than the biggest class goes straight to malloc. Build with
+ * -DLISPY_POOL_STATS to have the counters printed on exit.
+ */
+#define LPOOL_MIN_SHIFT 4
+#define LPOOL_CLASSES   6
+#define LPOOL_MAX       (1 << (LPOOL_MIN_SHIFT + LPOOL_CLASSES - 1))
+#define LPOOL_SLAB      (16 * 1024)
+
+typedef struct lfree
+{
+    struct lfree *next;
+} lfree;
+
+typedef struct lpool
+{
+    lfree *free[LPOOL_CLASSES];
+#ifdef LISPY_POOL_STATS
+    size_t allocs[LPOOL_CLASSES];
+    size_t frees[LPOOL_CLASSES];
+    size_t slabs[LPOOL_CLASSES];
+    size_t large;
+#endif
+} lpool;
+
+static _Thread_local lpool lval_pool;
+
+static inline int
+lpool_class (size_t size)
+{
+    int c = 0;
+    while (((size_t) 1 << (LPOOL_MIN_SHIFT + c)) < size) c++;
+    return c;
+}
+
+void *
+lpool_alloc (size_t size)
+{
+    if (size > LPOOL_MAX)
+    {
+#ifdef LISPY_POOL_STATS
+        lval_pool.large++;
+#endif
+        return malloc (size);
+    }
+
+    int c = lpool_class (size);
+
+    if (lval_pool.free[c] == NULL)
+    {
+        /* Thread a new slab onto the free list, slabs are never returned */
+        size_t block = (size_t) 1 << (LPOOL_MIN_SHIFT + c);
+        char *slab = malloc (LPOOL_SLAB);
+
+        for (size_t off = 0; off + block <= LPOOL_SLAB; off += block)
+        {
+            lfree *f = (lfree *) (slab + off);
+            f->next = lval_pool.free[c];
+            lval_pool.free[c] = f;
+        }
+#ifdef LISPY_POOL_STATS
+        lval_pool.slabs[c]++;
+#endif
+    }
+
+    lfree *f = lval_pool.free[c];
+    lval_pool.free[c] = f->next;
+#ifdef LISPY_POOL_STATS
+    lval_pool.allocs[c]++;
+#endif
+    return f;
+}
+
+void
+lpool_free (void *p, size_t size)
+{
+    if (p == NULL) return;
+
+    if (size > LPOOL_MAX)
+    {
+        free (p);
+        return;
+    }
+
+    int c = lpool_class (size);
+    lfree *f = p;
+    f->next = lval_pool.free[c];
+    lval_pool.free[c] = f;
+#ifdef LISPY_POOL_STATS
+    lval_pool.frees[c]++;
+#endif
+}
+
+void *
+lpool_realloc (void *p, size_t old, size_t size)
+{
+    /* Still fits the block it already has */
+    if (p != NULL && old <= LPOOL_MAX && size <= LPOOL_MAX
+        && lpool_class (old) == lpool_class (size))
+        return p;
+
+    if (p != NULL && old > LPOOL_MAX && size > LPOOL_MAX)
+        return realloc (p, size);
+
+    void *n = lpool_alloc (size);
+    if (p != NULL) memcpy (n, p, old < size ? old : size);
+    lpool_free (p, old);
+    return n;
+}
+
+#ifdef LISPY_POOL_STATS
+void
+lpool_print_stats (void)
+{
+    fprintf (stderr, "pool: class   allocs    frees    slabs\n");
+    for (int c = 0; c < LPOOL_CLASSES; c++)
+        fprintf (stderr, "pool: %5d %8zu %8zu %8zu\n", 1 << (LPOOL_MIN_SHIFT + c),
+                 lval_pool.allocs[c], lval_pool.frees[c], lval_pool.slabs[c]);
+    fprintf (stderr, "pool: large %8zu\n", lval_pool.large);
+}
+#endif
+
+/* Allocates "size" bytes that belong to "o" and live wherever "o" does */
+void *
+lobj_alloc (lobj *o, size_t size)
+{
+    return o->arena ? larena_alloc (lval_arena, size) : lpool_alloc (size);
+}
+
+void *
+lobj_realloc (lobj *o, void *p, size_t old, size_t size)
+{
+    return o->arena ? larena_grow (lval_arena, p, old, size) : lpool_realloc (p, old, size);
+}
+
+void
+lobj_free (lobj *o, void *p, size_t size)
+{
+    if (!o->arena) lpool_free (p, size);
+}
+
+lobj *
+lobj_new (lval_type type)
+{
+    lobj *o = lval_arena ? larena_alloc (lval_arena, sizeof (lobj)) : lpool_alloc (sizeof (lobj));
+    o->type = type;
+    o->arena = lval_arena != NULL;
+    o->refs = 1;
+    return o;
+}
+
+lval
+lval_int (long x)
+{
+    if (x >= LVAL_INT_MIN && x <= LVAL_INT_MAX)
+        return LVAL_TAG_INT | ((uint64_t) x & LVAL_PAYLOAD);
+
+    lobj *o = lobj_new (LVAL_INT);
+    o->inum = x;
+    return lval_box (o);
+}
+
+lval
+lval_double (double x)
+{
+    /* Collapse every NaN onto the canonical one so payloads can't alias a tag */
+    if (isnan (x)) x = NAN;
+
+    lval v;
+    memcpy (&v, &x, sizeof (v));
+    return v;
+}
+
+lval
+lval_err (char *fmt, ...)
+{
+    va_list va;
+    va_start (va, fmt);
+    int len = vsnprintf (NULL, 0, fmt, va);
+    va_end (va);
+
+    lobj *o = lobj_new (LVAL_ERR);
+    o->err = lobj_alloc (o, len + 1);
+
+    va_start (va, fmt);
+    vsnprintf (o->err, len + 1, fmt, va);
+    va_end (va);
+    return lval_box (o);
+}
+
+lval
+lval_sym (char *sym) { return LVAL_TAG_SYM | (uint64_t) latom_intern (sym); }
+
+lval
+lval_fun (lbuiltin op) { return LVAL_TAG_FUN | (uint64_t) op; }
+
+lval
+lval_sexpr (void)
+{
+    lobj *o = lobj_new (LVAL_SEXPR);
+    o->count = 0;
+    o->cap = 0;
+    o->cell = NULL;
+    return lval_box (o);
+}
+
+/*
+ * Arbitrary precision integers for whatever overflows a long. An lbig is
+ * a working value on the C heap: a sign and "len" base 2^32 limbs, least
+ * significant first, with no leading zero limbs. Results that fit a long
+ * go back to being plain ints, so an LVAL_BIG never does.
+ */
+#define LBIG_KARATSUBA 32       // Limbs below which schoolbook multiplication wins
+#define LBIG_MAX_BITS  (1l << 26)
+
+typedef struct lbig
+{
+    bool neg;
+    int len;
+    int cap;
+    uint32_t *limb;
+} lbig;
+
+/* A read-only view of the limbs of an LVAL_BIG */
+static inline lbig
+lval_as_big (lval v)
+{
+    lobj *o = lval_obj (v);
+    return (lbig) { o->big.neg, o->big.len, o->big.len, o->big.limb };
+}
+
+static inline int
+lbig_trim (const uint32_t *a, int n)
+{
+    while (n > 0 && a[n - 1] == 0) n--;
+    return n;
+}
+
+void
+lbig_reserve (lbig *a, int n)
+{
+    if (n <= a->cap) return;
+    a->limb = realloc (a->limb, sizeof (uint32_t) * n);
+    a->cap = n;
+}
+
+/* Replaces the limbs of "r" with the "n" limbs at "t", which it takes over */
+static void
+lbig_assign (lbig *r, uint32_t *t, int n, bool neg)
+{
+    free (r->limb);
+    r->limb = t;
+    r->cap = n;
+    r->len = lbig_trim (t, n);
+    r->neg = r->len > 0 && neg;
+}
+
+void
+lbig_free (lbig *a) { free (a->limb); }
+
+void
+lbig_set_long (lbig *r, long x)
+{
+    unsigned long m = x < 0 ? -(unsigned long) x : (unsigned long) x;
+
+    lbig_reserve (r, 2);
+    r->limb[0] = (uint32_t) m;
+    r->limb[1] = (uint32_t) (m >> 32);
+    r->len = lbig_trim (r->limb, 2);
+    r->neg = x < 0;
+}
+
+/* Loads an LVAL_INT or LVAL_BIG */
+void
+lbig_set (lbig *r, lval v)
+{
+    if (lval_type_of (v) != LVAL_BIG)
+    {
+        lbig_set_long (r, lval_as_int (v));
+        return;
+    }
+
+    lbig b = lval_as_big (v);
+    lbig_reserve (r, b.len);
+    memcpy (r->limb, b.limb, sizeof (uint32_t) * b.len);
+    r->len = b.len;
+    r->neg = b.neg;
+}
+
+double
+lbig_to_double (const lbig *a)
+{
+    double d = 0;
+    for (int i = a->len - 1; i >= 0; i--) d = d * 4294967296.0 + a->limb[i];
+    return a->neg ? -d : d;
+}
+
+static int
+lbig_cmp_mag (const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+    if (an != bn) return an < bn ? -1 : 1;
+    for (int i = an - 1; i >= 0; i--)
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+int
+lbig_cmp (const lbig *a, const lbig *b)
+{
+    if (a->neg != b->neg) return a->neg ? -1 : 1;
+    int c = lbig_cmp_mag (a->limb, a->len, b->limb, b->len);
+    return a->neg ? -c : c;
+}
+
+/* r += x over the "rn" limbs of r, which must have room for the carry */
+static void
+lbig_add_into (uint32_t *r, int rn, const uint32_t *x, int xn)
+{
+    uint64_t carry = 0;
+    int i = 0;
+
+    for (; i < xn; i++)
+    {
+        uint64_t t = (uint64_t) r[i] + x[i] + carry;
+        r[i] = (uint32_t) t;
+        carry = t >> 32;
+    }
+    for (; carry && i < rn; i++)
+    {
+        uint64_t t = (uint64_t) r[i] + carry;
+        r[i] = (uint32_t) t;
+        carry = t >> 32;
+    }
+}
+
+/* r -= x over the "rn" limbs of r, where r >= x */
+static void
+lbig_sub_into (uint32_t *r, int rn, const uint32_t *x, int xn)
+{
+    uint64_t borrow = 0;
+    int i = 0;
+
+    for (; i < xn; i++)
+    {
+        uint64_t t = (uint64_t) r[i] - x[i] - borrow;
+        r[i] = (uint32_t) t;
+        borrow = (t >> 32) & 1;
+    }
+    for (; borrow && i < rn; i++)
+    {
+        uint64_t t = (uint64_t) r[i] - borrow;
+        r[i] = (uint32_t) t;
+        borrow = (t >> 32) & 1;
+    }
+}
+
+/* r = a + b, or a - b when "negate" is set; "r" may be "a" or "b" */
+void
+lbig_add (lbig *r, const lbig *a, const lbig *b, bool negate)
+{
+    bool bneg = b->neg != negate;
+    int n = (a->len > b->len ? a->len : b->len) + 1;
+    uint32_t *t = calloc (n, sizeof (uint32_t));
+    bool neg;
+
+    if (a->neg == bneg || lbig_cmp_mag (a->limb, a->len, b->limb, b->len) >= 0)
+    {
+        if (a->len) memcpy (t, a->limb, sizeof (uint32_t) * a->len);
+        if (a->neg == bneg) lbig_add_into (t, n, b->limb, b->len);
+        else lbig_sub_into (t, n, b->limb, b->len);
+        neg = a->neg;
+    }
+    else
+    {
+        memcpy (t, b->limb, sizeof (uint32_t) * b->len);
+        lbig_sub_into (t, n, a->limb, a->len);
+        neg = bneg;
+    }
+    lbig_assign (r, t, n, neg);
+}
+
+/*
+ * r += a * b over zeroed limbs at "r", an + bn of them. Large operands
+ * are split at m limbs into a1 B^m + a0 and b1 B^m + b0, and the middle
+ * term (a0 + a1)(b0 + b1) - a0 b0 - a1 b1 costs one product instead of
+ * two, giving Karatsuba's O(n^1.585).
+ */
+static void
+lbig_mul_mag (uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+    if (an < LBIG_KARATSUBA || bn < LBIG_KARATSUBA)
+    {
+        for (int i = 0; i < an; i++)
+        {
+            uint64_t carry = 0;
+            for (int j = 0; j < bn; j++)
+            {
+                uint64_t t = (uint64_t) a[i] * b[j] + r[i + j] + carry;
+                r[i + j] = (uint32_t) t;
+                carry = t >> 32;
+            }
+            r[i + bn] = (uint32_t) carry;
+        }
+        return;
+    }
+
+    int m = (an > bn ? an : bn) / 2;
+    int a0n = lbig_trim (a, an < m ? an : m), a1n = an > m ? an - m : 0;
+    int b0n = lbig_trim (b, bn < m ? bn : m), b1n = bn > m ? bn - m : 0;
+
+    /* The half sums, which may carry into one more limb */
+    int san = (a0n > a1n ? a0n : a1n) + 1;
+    int sbn = (b0n > b1n ? b0n : b1n) + 1;
+    uint32_t *sa = calloc (san + sbn, sizeof (uint32_t));
+    uint32_t *sb = sa + san;
+    memcpy (sa, a, sizeof (uint32_t) * a0n);
+    memcpy (sb, b, sizeof (uint32_t) * b0n);
+    lbig_add_into (sa, san, a + m, a1n);
+    lbig_add_into (sb, sbn, b + m, b1n);
+    san = lbig_trim (sa, san);
+    sbn = lbig_trim (sb, sbn);
+
+    int z0n = a0n + b0n, z2n = a1n && b1n ? a1n + b1n : 0, z1n = san + sbn;
+    uint32_t *z0 = calloc (z0n + z2n + z1n + 1, sizeof (uint32_t));
+    uint32_t *z2 = z0 + z0n;
+    uint32_t *z1 = z2 + z2n;
+
+    if (a0n && b0n) lbig_mul_mag (z0, a, a0n, b, b0n);
+    if (a1n && b1n) lbig_mul_mag (z2, a + m, a1n, b + m, b1n);
+    if (san && sbn) lbig_mul_mag (z1, sa, san, sb, sbn);
+    lbig_sub_into (z1, z1n, z0, z0n);
+    lbig_sub_into (z1, z1n, z2, z2n);
+
+    lbig_add_into (r, an + bn, z0, z0n);
+    lbig_add_into (r + m, an + bn - m, z1, lbig_trim (z1, z1n));
+    lbig_add_into (r + 2 * m, an + bn - 2 * m, z2, z2n);
+
+    free (sa);
+    free (z0);
+}
+
+/* r = a * b; "r" may be "a" or "b" */
+void
+lbig_mul (lbig *r, const lbig *a, const lbig *b)
+{
+    int n = a->len + b->len;
+    uint32_t *t = calloc (n ? n : 1, sizeof (uint32_t));
+
+    if (a->len && b->len) lbig_mul_mag (t, a->limb, a->len, b->limb, b->len);
+    lbig_assign (r, t, n, a->neg != b->neg);
+}
+
+/*
+ * Long division of magnitudes, Knuth's algorithm D: q = u / v and
+ * rem = u % v, with u >= v > 0 and "q" zeroed. Both operands are shifted
+ * so v's top limb has its high bit set, which keeps every estimated
+ * quotient limb at most two too large.
+ */
+static void
+lbig_divmod_mag (uint32_t *q, uint32_t *rem, const uint32_t *u, int m, const uint32_t *v, int n)
+{
+    const uint64_t B = 1ull << 32;
+
+    if (n == 1)
+    {
+        uint64_t k = 0;
+        for (int j = m - 1; j >= 0; j--)
+        {
+            uint64_t t = k * B + u[j];
+            q[j] = (uint32_t) (t / v[0]);
+            k = t % v[0];
+        }
+        rem[0] = (uint32_t) k;
+        return;
+    }
+
+    int s = __builtin_clz (v[n - 1]);
+    uint32_t *vn = malloc (sizeof (uint32_t) * (n + m + 1));
+    uint32_t *un = vn + n;
+
+    for (int i = n - 1; i > 0; i--)
+        vn[i] = (v[i] << s) | (s ? (uint32_t) ((uint64_t) v[i - 1] >> (32 - s)) : 0);
+    vn[0] = v[0] << s;
+
+    un[m] = s ? (uint32_t) ((uint64_t) u[m - 1] >> (32 - s)) : 0;
+    for (int i = m - 1; i > 0; i--)
+        un[i] = (u[i] << s) | (s ? (uint32_t) ((uint64_t) u[i - 1] >> (32 - s)) : 0);
+    un[0] = u[0] << s;
+
+    for (int j = m - n; j >= 0; j--)
+    {
+        /* Estimate the quotient limb from the top two limbs */
+        uint64_t top = (uint64_t) un[j + n] * B + un[j + n - 1];
+        uint64_t qhat = top / vn[n - 1];
+        uint64_t rhat = top % vn[n - 1];
+
+        while (qhat >= B || qhat * vn[n - 2] > B * rhat + un[j + n - 2])
+        {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >= B) break;
+        }
+
+        /* Multiply and subtract */
+        int64_t t = 0;
+        uint64_t k = 0;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t) un[i + j] - (int64_t) k - (int64_t) (p & 0xFFFFFFFF);
+            un[i + j] = (uint32_t) t;
+            k = (p >> 32) - (t >> 32);
+        }
+        t = (int64_t) un[j + n] - (int64_t) k;
+        un[j + n] = (uint32_t) t;
+
+        /* Subtracted one too many, add back */
+        if (t < 0)
+        {
+            qhat--;
+            k = 0;
+            for (int i = 0; i < n; i++)
+            {
+                uint64_t sum = (uint64_t) un[i + j] + vn[i] + k;
+                un[i + j] = (uint32_t) sum;
+                k = sum >> 32;
+            }
+            un[j + n] += (uint32_t) k;
+        }
+        q[j] = (uint32_t) qhat;
+    }
+
+    for (int i = 0; i < n; i++)
+        rem[i] = (un[i] >> s) | (s ? (uint32_t) ((uint64_t) un[i + 1] << (32 - s)) : 0);
+    free (vn);
+}
+
+/*
+ * q = a / b and rem = a % b, truncating like C does, for nonzero "b".
+ * Either result may be NULL, or be "a" or "b".
+ */
+void
+lbig_divmod (lbig *q, lbig *rem, const lbig *a, const lbig *b)
+{
+    int qn = a->len >= b->len ? a->len - b->len + 1 : 1;
+    uint32_t *qt = calloc (qn, sizeof (uint32_t));
+    uint32_t *rt = calloc (b->len, sizeof (uint32_t));
+
+    if (lbig_cmp_mag (a->limb, a->len, b->limb, b->len) < 0)
+    {
+        if (a->len) memcpy (rt, a->limb, sizeof (uint32_t) * a->len);
+    }
+    else lbig_divmod_mag (qt, rt, a->limb, a->len, b->limb, b->len);
+
+    bool qneg = a->neg != b->neg;
+    bool rneg = a->neg;
+
+    if (q) lbig_assign (q, qt, qn, qneg);
+    else free (qt);
+    if (rem) lbig_assign (rem, rt, b->len, rneg);
+    else free (rt);
+}
+
+/* r = a^e by repeated squaring, so only log2 e multiplications */
+void
+lbig_pow (lbig *r, const lbig *a, unsigned long e)
+{
+    lbig base = { 0 };
+    lbig acc = { 0 };
+
+    lbig_reserve (&base, a->len ? a->len : 1);
+    memcpy (base.limb, a->limb, sizeof (uint32_t) * a->len);
+    base.len = a->len;
+    base.neg = a->neg;
+    lbig_set_long (&acc, 1);
+
+    while (e)
+    {
+        if (e & 1) lbig_mul (&acc, &acc, &base);
+        e >>= 1;
+        if (e) lbig_mul (&base, &base, &base);
+    }
+
+    lbig_free (&base);
+    lbig_free (r);
+    *r = acc;
+}
+
+/* Bits in the magnitude of "a" */
+long
+lbig_bits (const lbig *a)
+{
+    if (a->len == 0) return 0;
+    return 32l * a->len - __builtin_clz (a->limb[a->len - 1]);
+}
+
+/* Decimal digits of "a", which the caller frees */
+char *
+lbig_to_string (const lbig *a)
+{
+    int n = a->len;
+    int size = 10 * n + 2;
+    uint32_t *t = malloc (sizeof (uint32_t) * (n ? n : 1));
+    char *s = malloc (size);
+    char *p = s + size - 1;
+
+    memcpy (t, a->limb, sizeof (uint32_t) * n);
+    *p = '\0';
+    if (n == 0) *--p = '0';
+
+    /* Peel off nine digits per pass, padding every chunk but the leading one */
+    while (n > 0)
+    {
+        uint64_t k = 0;
+        for (int i = n - 1; i >= 0; i--)
+        {
+            uint64_t cur = (k << 32) | t[i];
+            t[i] = (uint32_t) (cur / 1000000000);
+            k = cur % 1000000000;
+        }
+        n = lbig_trim (t, n);
+
+        for (int d = 0; d < 9 && (n > 0 || k > 0); d++)
+        {
+            *--p = '0' + k % 10;
+            k /= 10;
+        }
+    }
+    if (a->neg) *--p = '-';
+
+    memmove (s, p, strlen (p) + 1);
+    free (t);
+    return s;
+}
+
+/* Parses an optionally signed string of decimal digits */
+void
+lbig_set_string (lbig *r, const char *s)
+{
+    bool neg = *s == '-';
+    if (*s == '-' || *s == '+') s++;
+
+    lbig_reserve (r, strlen (s) / 9 + 2);
+    r->len = 0;
+
+    /* Fold in up to nine digits at a time */
+    while (*s >= '0' && *s <= '9')
+    {
+        uint64_t chunk = 0;
+        uint64_t scale = 1;
+        for (int d = 0; d < 9 && *s >= '0' && *s <= '9'; d++, s++)
+        {
+            chunk = chunk * 10 + (*s - '0');
+            scale *= 10;
+        }
+
+        for (int i = 0; i < r->len; i++)
+        {
+            uint64_t t = (uint64_t) r->limb[i] * scale + chunk;
+            r->limb[i] = (uint32_t) t;
+            chunk = t >> 32;
+        }
+        if (chunk) r->limb[r->len++] = (uint32_t) chunk;
+    }
+    r->neg = neg && r->len > 0;
+}
+
+/* The lval for "a", a plain int whenever it fits a long */
+lval
+lval_big (const lbig *a)
+{
+    if (a->len <= 2)
+    {
+        uint64_t m = a->len ? a->limb[0] : 0;
+        if (a->len == 2) m |= (uint64_t) a->limb[1] << 32;
+
+        if (!a->neg && m <= LONG_MAX) return lval_int ((long) m);
+        if (a->neg && m <= (uint64_t) LONG_MAX) return lval_int (-(long) m);
+        if (a->neg && m == (uint64_t) LONG_MAX + 1) return lval_int (LONG_MIN);
+    }
+
+    lobj *o = lobj_new (LVAL_BIG);
+    o->big.len = a->len;
+    o->big.neg = a->neg;
+    o->big.limb = lobj_alloc (o, sizeof (uint32_t) * a->len);
+    memcpy (o->big.limb, a->limb, sizeof (uint32_t) * a->len);
+    return lval_box (o);
+}
+
+static inline bool
+lval_is_number (lval v)
+{
+    lval_type t = lval_type_of (v);
+    return t == LVAL_INT || t == LVAL_BIG || t == LVAL_DOUBLE;
+}
+
+static inline bool
+lval_is_integer (lval v)
+{
+    lval_type t = lval_type_of (v);
+    return t == LVAL_INT || t == LVAL_BIG;
+}
+
+/* Any number as a double, rounding bignums */
+double
+lval_to_double (lval v)
+{
+    switch (lval_type_of (v))
+    {
+    case LVAL_INT : return lval_as_int (v);
+    case LVAL_BIG :
+    {
+        lbig b = lval_as_big (v);
+        return lbig_to_double (&b);
+    }
+    default       : return lval_as_double (v);
+    }
+}
+
+/* Orders two integers, either of which may be a bignum */
+int
+lval_int_cmp (lval a, lval b)
+{
+    if (lval_type_of (a) == LVAL_INT && lval_type_of (b) == LVAL_INT)
+    {
+        long x = lval_as_int (a);
+        long y = lval_as_int (b);
+        return (x > y) - (x < y);
+    }
+
+    lbig x = { 0 };
+    lbig y = { 0 };
+    lbig_set (&x, a);
+    lbig_set (&y, b);
+    int c = lbig_cmp (&x, &y);
+    lbig_free (&x);
+    lbig_free (&y);
+    return c;
+}
+
+/*
+ * Packed numeric vectors, [1 2 3] or [0.5 1 2], keep their elements
+ * unboxed in one buffer: longs, or doubles when any literal has a point.
+ * The + - * / kernels work on whole buffers and lvec_init swaps in SIMD
+ * versions for the widest extension the CPU turns out to have.
+ */
+lval
+lval_vec (bool real, int len)
+{
+    lobj *o = lobj_new (LVAL_VEC);
+    o->vec.len = len;
+    o->vec.real = real;
+    o->vec.data = len ? lobj_alloc (o, sizeof (long) * len) : NULL;
+    return lval_box (o);
+}
+
+static inline double
+lvec_real_at (lobj *o, int i) { return o->vec.real ? o->vec.reals[i] : o->vec.ints[i]; }
+
+#define LVEC_REAL_LOOP(name, op)                                            \
+    static void                                                             \
+    name (double *r, const double *a, const double *b, int n)               \
+    {                                                                       \
+        for (int i = 0; i < n; i++) r[i] = a[i] op b[i];                    \
+    }
+
+LVEC_REAL_LOOP (lvec_add_real, +)
+LVEC_REAL_LOOP (lvec_sub_real, -)
+LVEC_REAL_LOOP (lvec_mul_real, *)
+LVEC_REAL_LOOP (lvec_div_real, /)
+
+/*
+ * Integer + and - wrap like unsigned math and return whether any element
+ * overflowed, which shows as a sign bit: the result's sign disagrees with
+ * both operands' for +, and with the minuend's when their signs differ for -.
+ */
+static bool
+lvec_add_int (long *r, const long *a, const long *b, int n)
+{
+    long over = 0;
+    for (int i = 0; i < n; i++)
+    {
+        long s = (long) ((unsigned long) a[i] + (unsigned long) b[i]);
+        over |= (a[i] ^ s) & (b[i] ^ s);
+        r[i] = s;
+    }
+    return over < 0;
+}
+
+static bool
+lvec_sub_int (long *r, const long *a, const long *b, int n)
+{
+    long over = 0;
+    for (int i = 0; i < n; i++)
+    {
+        long s = (long) ((unsigned long) a[i] - (unsigned long) b[i]);
+        over |= (a[i] ^ b[i]) & (a[i] ^ s);
+        r[i] = s;
+    }
+    return over < 0;
+}
+
+typedef void (*lvec_real_fn) (double *r, const double *a, const double *b, int n);
+typedef bool (*lvec_int_fn) (long *r, const long *a, const long *b, int n);
+
+/* Kernels indexed by lbuiltin, doubles for + - * / and longs for + - */
+static lvec_real_fn lvec_real[BUILTIN_DIV + 1] =
+{
+    lvec_add_real, lvec_sub_real, lvec_mul_real, lvec_div_real
+};
+static lvec_int_fn lvec_int[BUILTIN_SUB + 1] = { lvec_add_int, lvec_sub_int };
+
+/*
+ * Reductions over a vector of doubles, each kept in four accumulators so
+ * consecutive steps don't wait on one another. Sums and dot products go
+ * through blocks of LVEC_BLOCK elements combined pairwise, so rounding
+ * error grows with the log of the length rather than the length.
+ */
+#define LVEC_BLOCK 1024
+
+#define LVEC_ADD(x, y) ((x) + (y))
+#define LVEC_MUL(x, y) ((x) * (y))
+#define LVEC_MIN(x, y) ((y) < (x) ? (y) : (x))
+#define LVEC_MAX(x, y) ((y) > (x) ? (y) : (x))
+
+#define LVEC_FOLD_LOOP(name, init, op)                                      \
+    static double                                                           \
+    name (const double *a, int n)                                           \
+    {                                                                       \
+        double acc[4] = { init, init, init, init };                         \
+        int i = 0;                                                          \
+        for (; i + 4 <= n; i += 4)                                          \
+            for (int k = 0; k < 4; k++) acc[k] = op (acc[k], a[i + k]);     \
+        for (; i < n; i++) acc[0] = op (acc[0], a[i]);                      \
+        return op (op (acc[0], acc[1]), op (acc[2], acc[3]));               \
+    }
+
+LVEC_FOLD_LOOP (lvec_sum_real, 0.0, LVEC_ADD)
+LVEC_FOLD_LOOP (lvec_prod_real, 1.0, LVEC_MUL)
+LVEC_FOLD_LOOP (lvec_min_real, INFINITY, LVEC_MIN)
+LVEC_FOLD_LOOP (lvec_max_real, -INFINITY, LVEC_MAX)
+
+static double
+lvec_dot_real (const double *a, const double *b, int n)
+{
+    double acc[4] = { 0 };
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        for (int k = 0; k < 4; k++) acc[k] += a[i + k] * b[i + k];
+    for (; i < n; i++) acc[0] += a[i] * b[i];
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+/* Sums longs into "sum", returning false if it overflowed on the way */
+static bool
+lvec_sum_int (const long *a, int n, long *sum)
+{
+    long acc = 0;
+    long over = 0;
+    for (int i = 0; i < n; i++)
+    {
+        long s = (long) ((unsigned long) acc + (unsigned long) a[i]);
+        over |= (acc ^ s) & (a[i] ^ s);
+        acc = s;
+    }
+    *sum = acc;
+    return over >= 0;
+}
+
+static long
+lvec_min_int (const long *a, int n)
+{
+    long m = LONG_MAX;
+    for (int i = 0; i < n; i++) m = LVEC_MIN (m, a[i]);
+    return m;
+}
+
+static long
+lvec_max_int (const long *a, int n)
+{
+    long m = LONG_MIN;
+    for (int i = 0; i < n; i++) m = LVEC_MAX (m, a[i]);
+    return m;
+}
+
+typedef double (*lvec_fold_fn) (const double *a, int n);
+typedef double (*lvec_dot_fn) (const double *a, const double *b, int n);
+typedef bool (*lvec_sum_fn) (const long *a, int n, long *sum);
+typedef long (*lvec_pick_fn) (const long *a, int n);
+
+/* Reduction kernels, the folds indexed from BUILTIN_SUM: sum prod min max */
+static lvec_fold_fn lvec_fold[4] = { lvec_sum_real, lvec_prod_real, lvec_min_real, lvec_max_real };
+static lvec_dot_fn lvec_dot = lvec_dot_real;
+static lvec_sum_fn lvec_sum = lvec_sum_int;
+static lvec_pick_fn lvec_min = lvec_min_int;
+static lvec_pick_fn lvec_max = lvec_max_int;
+
+#if defined (__x86_64__)
+
+#include <immintrin.h>
+
+/* "w" lanes at a time with the "pfx" intrinsics, leaving the rest to "tail" */
+#define LVEC_REAL_SIMD(name, isa, vt, pfx, op, tail)                        \
+    __attribute__ ((target (isa))) static void                              \
+    name (double *r, const double *a, const double *b, int n)               \
+    {                                                                       \
+        const int w = sizeof (vt) / sizeof (double);                        \
+        int i = 0;                                                          \
+        for (; i + w <= n; i += w)                                          \
+            pfx##_storeu_pd (r + i, pfx##_##op##_pd (pfx##_loadu_pd (a + i), \
+                                                     pfx##_loadu_pd (b + i))); \
+        tail (r + i, a + i, b + i, n - i);                                  \
+    }
+
+/* As above for longs, with "mask" building the overflow bits from x, y and s */
+#define LVEC_INT_SIMD(name, isa, vt, pfx, si, op, mask, tail)               \
+    __attribute__ ((target (isa))) static bool                              \
+    name (long *r, const long *a, const long *b, int n)                     \
+    {                                                                       \
+        const int w = sizeof (vt) / sizeof (long);                          \
+        vt over = pfx##_setzero_##si ();                                    \
+        int i = 0;                                                          \
+        for (; i + w <= n; i += w)                                          \
+        {                                                                   \
+            vt x = pfx##_loadu_##si ((const vt *) (a + i));                 \
+            vt y = pfx##_loadu_##si ((const vt *) (b + i));                 \
+            vt s = pfx##_##op##_epi64 (x, y);                               \
+            over = pfx##_or_##si (over, mask);                              \
+            pfx##_storeu_##si ((vt *) (r + i), s);                          \
+        }                                                                   \
+        bool lanes = pfx##_movemask_pd (pfx##_cast##si##_pd (over)) != 0;   \
+        return tail (r + i, a + i, b + i, n - i) || lanes;                  \
+    }
+
+LVEC_REAL_SIMD (lvec_add_real_avx2, "avx2", __m256d, _mm256, add, lvec_add_real)
+LVEC_REAL_SIMD (lvec_sub_real_avx2, "avx2", __m256d, _mm256, sub, lvec_sub_real)
+LVEC_REAL_SIMD (lvec_mul_real_avx2, "avx2", __m256d, _mm256, mul, lvec_mul_real)
+LVEC_REAL_SIMD (lvec_div_real_avx2, "avx2", __m256d, _mm256, div, lvec_div_real)
+LVEC_REAL_SIMD (lvec_add_real_sse2, "sse2", __m128d, _mm, add, lvec_add_real)
+LVEC_REAL_SIMD (lvec_sub_real_sse2, "sse2", __m128d, _mm, sub, lvec_sub_real)
+LVEC_REAL_SIMD (lvec_mul_real_sse2, "sse2", __m128d, _mm, mul, lvec_mul_real)
+LVEC_REAL_SIMD (lvec_div_real_sse2, "sse2", __m128d, _mm, div, lvec_div_real)
+
+LVEC_INT_SIMD (lvec_add_int_avx2, "avx2", __m256i, _mm256, si256, add,
+               _mm256_and_si256 (_mm256_xor_si256 (x, s), _mm256_xor_si256 (y, s)), lvec_add_int)
+LVEC_INT_SIMD (lvec_sub_int_avx2, "avx2", __m256i, _mm256, si256, sub,
+               _mm256_and_si256 (_mm256_xor_si256 (x, y), _mm256_xor_si256 (x, s)), lvec_sub_int)
+LVEC_INT_SIMD (lvec_add_int_sse2, "sse2", __m128i, _mm, si128, add,
+               _mm_and_si128 (_mm_xor_si128 (x, s), _mm_xor_si128 (y, s)), lvec_add_int)
+LVEC_INT_SIMD (lvec_sub_int_sse2, "sse2", __m128i, _mm, si128, sub,
+               _mm_and_si128 (_mm_xor_si128 (x, y), _mm_xor_si128 (x, s)), lvec_sub_int)
+
+/* Four vector accumulators combined with "op", then the lanes with "sop" */
+#define LVEC_FOLD_SIMD(name, isa, vt, pfx, op, init, sop, tail)             \
+    __attribute__ ((target (isa))) static double                            \
+    name (const double *a, int n)                                           \
+    {                                                                       \
+        const int w = sizeof (vt) / sizeof (double);                        \
+        vt acc0 = pfx##_set1_pd (init), acc1 = acc0, acc2 = acc0, acc3 = acc0; \
+        int i = 0;                                                          \
+        for (; i + 4 * w <= n; i += 4 * w)                                  \
+        {                                                                   \
+            acc0 = pfx##_##op##_pd (acc0, pfx##_loadu_pd (a + i));          \
+            acc1 = pfx##_##op##_pd (acc1, pfx##_loadu_pd (a + i + w));      \
+            acc2 = pfx##_##op##_pd (acc2, pfx##_loadu_pd (a + i + 2 * w));  \
+            acc3 = pfx##_##op##_pd (acc3, pfx##_loadu_pd (a + i + 3 * w));  \
+        }                                                                   \
+        acc0 = pfx##_##op##_pd (pfx##_##op##_pd (acc0, acc1),               \
+                                pfx##_##op##_pd (acc2, acc3));              \
+                                                                            \
+        double lanes[sizeof (vt) / sizeof (double)];                        \
+        pfx##_storeu_pd (lanes, acc0);                                      \
+        double x = tail (a + i, n - i);                                     \
+        for (int k = 0; k < w; k++) x = sop (x, lanes[k]);                  \
+        return x;                                                           \
+    }
+
+#define LVEC_DOT_SIMD(name, isa, vt, pfx)                                   \
+    __attribute__ ((target (isa))) static double                            \
+    name (const double *a, const double *b, int n)                          \
+    {                                                                       \
+        const int w = sizeof (vt) / sizeof (double);                        \
+        vt acc0 = pfx##_setzero_pd (), acc1 = acc0, acc2 = acc0, acc3 = acc0; \
+        int i = 0;                                                          \
+        for (; i + 4 * w <= n; i += 4 * w)                                  \
+        {                                                                   \
+            acc0 = pfx##_add_pd (acc0, pfx##_mul_pd (pfx##_loadu_pd (a + i), \
+                                                     pfx##_loadu_pd (b + i))); \
+            acc1 = pfx##_add_pd (acc1, pfx##_mul_pd (pfx##_loadu_pd (a + i + w), \
+                                                     pfx##_loadu_pd (b + i + w))); \
+            acc2 = pfx##_add_pd (acc2, pfx##_mul_pd (pfx##_loadu_pd (a + i + 2 * w), \
+                                                     pfx##_loadu_pd (b + i + 2 * w))); \
+            acc3 = pfx##_add_pd (acc3, pfx##_mul_pd (pfx##_loadu_pd (a + i + 3 * w), \
+                                                     pfx##_loadu_pd (b + i + 3 * w))); \
+        }                                                                   \
+        acc0 = pfx##_add_pd (pfx##_add_pd (acc0, acc1), pfx##_add_pd (acc2, acc3)); \
+                                                                            \
+        double lanes[sizeof (vt) / sizeof (double)];                        \
+        pfx##_storeu_pd (lanes, acc0);                                      \
+        double x = lvec_dot_real (a + i, b + i, n - i);                     \
+        for (int k = 0; k < w; k++) x += lanes[k];                          \
+        return x;                                                           \
+    }
+
+/* One vector accumulator whose lanes are summed checked at the end */
+#define LVEC_SUM_SIMD(name, isa, vt, pfx, si)                               \
+    __attribute__ ((target (isa))) static bool                              \
+    name (const long *a, int n, long *sum)                                  \
+    {                                                                       \
+        const int w = sizeof (vt) / sizeof (long);                          \
+        vt acc = pfx##_setzero_##si ();                                     \
+        vt over = acc;                                                      \
+        int i = 0;                                                          \
+        for (; i + w <= n; i += w)                                          \
+        {                                                                   \
+            vt x = pfx##_loadu_##si ((const vt *) (a + i));                 \
+            vt s = pfx##_add_epi64 (acc, x);                                \
+            over = pfx##_or_##si (over, pfx##_and_##si (pfx##_xor_##si (acc, s), \
+                                                        pfx##_xor_##si (x, s))); \
+            acc = s;                                                        \
+        }                                                                   \
+        if (pfx##_movemask_pd (pfx##_cast##si##_pd (over))) return false;   \
+                                                                            \
+        long lanes[sizeof (vt) / sizeof (long)];                            \
+        pfx##_storeu_##si ((vt *) lanes, acc);                              \
+        if (!lvec_sum_int (a + i, n - i, sum)) return false;                \
+        for (int k = 0; k < w; k++)                                         \
+            if (__builtin_add_overflow (*sum, lanes[k], sum)) return false; \
+        return true;                                                        \
+    }
+
+LVEC_FOLD_SIMD (lvec_sum_real_avx2, "avx2", __m256d, _mm256, add, 0.0, LVEC_ADD, lvec_sum_real)
+LVEC_FOLD_SIMD (lvec_prod_real_avx2, "avx2", __m256d, _mm256, mul, 1.0, LVEC_MUL, lvec_prod_real)
+LVEC_FOLD_SIMD (lvec_min_real_avx2, "avx2", __m256d, _mm256, min, INFINITY, LVEC_MIN, lvec_min_real)
+LVEC_FOLD_SIMD (lvec_max_real_avx2, "avx2", __m256d, _mm256, max, -INFINITY, LVEC_MAX, lvec_max_real)
+LVEC_FOLD_SIMD (lvec_sum_real_sse2, "sse2", __m128d, _mm, add, 0.0, LVEC_ADD, lvec_sum_real)
+LVEC_FOLD_SIMD (lvec_prod_real_sse2, "sse2", __m128d, _mm, mul, 1.0, LVEC_MUL, lvec_prod_real)
+LVEC_FOLD_SIMD (lvec_min_real_sse2, "sse2", __m128d, _mm, min, INFINITY, LVEC_MIN, lvec_min_real)
+LVEC_FOLD_SIMD (lvec_max_real_sse2, "sse2", __m128d, _mm, max, -INFINITY, LVEC_MAX, lvec_max_real)
+
+LVEC_DOT_SIMD (lvec_dot_real_avx2, "avx2", __m256d, _mm256)
+LVEC_DOT_SIMD (lvec_dot_real_sse2, "sse2", __m128d, _mm)
+
+LVEC_SUM_SIMD (lvec_sum_int_avx2, "avx2", __m256i, _mm256, si256)
+LVEC_SUM_SIMD (lvec_sum_int_sse2, "sse2", __m128i, _mm, si128)
+
+/* 64 bit compares only arrived with SSE4.2, so int min and max are AVX2 or nothing */
+#define LVEC_PICK_AVX2(name, keep, init, tail)                              \
+    __attribute__ ((target ("avx2"))) static long                           \
+    name (const long *a, int n)                                             \
+    {                                                                       \
+        __m256i m0 = _mm256_set1_epi64x (init), m1 = m0;                    \
+        int i = 0;                                                          \
+        for (; i + 8 <= n; i += 8)                                          \
+        {                                                                   \
+            __m256i x0 = _mm256_loadu_si256 ((const __m256i *) (a + i));    \
+            __m256i x1 = _mm256_loadu_si256 ((const __m256i *) (a + i + 4)); \
+            m0 = _mm256_blendv_epi8 (m0, x0, keep (x0, m0));                \
+            m1 = _mm256_blendv_epi8 (m1, x1, keep (x1, m1));                \
+        }                                                                   \
+        m0 = _mm256_blendv_epi8 (m0, m1, keep (m1, m0));                    \
+                                                                            \
+        long lanes[4];                                                      \
+        _mm256_storeu_si256 ((__m256i *) lanes, m0);                        \
+        long x = tail (a + i, n - i);                                       \
+        for (int k = 0; k < 4; k++) x = keep##_S (x, lanes[k]);             \
+        return x;                                                           \
+    }
+
+/* Lanes where "x" beats "m" */
+#define LVEC_LT(x, m) _mm256_cmpgt_epi64 (m, x)
+#define LVEC_GT(x, m) _mm256_cmpgt_epi64 (x, m)
+#define LVEC_LT_S LVEC_MIN
+#define LVEC_GT_S LVEC_MAX
+
+LVEC_PICK_AVX2 (lvec_min_int_avx2, LVEC_LT, LONG_MAX, lvec_min_int)
+LVEC_PICK_AVX2 (lvec_max_int_avx2, LVEC_GT, LONG_MIN, lvec_max_int)
+
+#endif
+
+/*
+ * Dense matrices of doubles, stored row-major in one buffer and built
+ * from vectors with (matrix rows cols v). Elements are only boxed when
+ * (at m i j) hands one out.
+ */
+lval
+lval_mat (int rows, int cols)
+{
+    lobj *o = lobj_new (LVAL_MAT);
+    size_t n = (size_t) rows * cols;
+    o->mat.rows = rows;
+    o->mat.cols = cols;
+    o->mat.data = n ? lobj_alloc (o, sizeof (double) * n) : NULL;
+    return lval_box (o);
+}
+
+/*
+ * matmul follows the usual GEMM blocking. B is copied a KC x NC block at
+ * a time into panels of NR columns laid out in the order the kernel reads
+ * them, a panel staying in L1 while the kernel walks down MR rows of A at
+ * a time, accumulating an MR x NR tile of C in registers.
+ */
+#define LMAT_MR 4
+#define LMAT_NR 8
+#define LMAT_KC 256
+#define LMAT_NC 512
+#define LMAT_MC 64
+
+/* C[mr x nr] += A[mr x kc] * one packed panel of B, for "lda" and "ldc" strides */
+typedef void (*lmat_kernel_fn) (int kc, const double *a, int lda, const double *bp,
+                                double *c, int ldc, int mr, int nr);
+
+static void
+lmat_kernel_c (int kc, const double *a, int lda, const double *bp, double *c, int ldc, int mr, int nr)
+{
+    double acc[LMAT_MR][LMAT_NR] = { { 0 } };
+
+    for (int p = 0; p < kc; p++)
+        for (int r = 0; r < mr; r++)
+        {
+            double x = a[r * lda + p];
+            for (int j = 0; j < LMAT_NR; j++) acc[r][j] += x * bp[p * LMAT_NR + j];
+        }
+
+    for (int r = 0; r < mr; r++)
+        for (int j = 0; j < nr; j++) c[r * ldc + j] += acc[r][j];
+}
+
+static lmat_kernel_fn lmat_kernel = lmat_kernel_c;
+
+#if defined (__x86_64__)
+
+/* The 4 x 8 tile in eight ymm registers, two fused multiply-adds per row and step */
+__attribute__ ((target ("avx2,fma"))) static void
+lmat_kernel_avx2 (int kc, const double *a, int lda, const double *bp, double *c, int ldc, int mr, int nr)
+{
+    if (mr < LMAT_MR)
+    {
+        lmat_kernel_c (kc, a, lda, bp, c, ldc, mr, nr);
+        return;
+    }
+
+    __m256d acc[LMAT_MR][2];
+    for (int r = 0; r < LMAT_MR; r++) acc[r][0] = acc[r][1] = _mm256_setzero_pd ();
+
+    for (int p = 0; p < kc; p++)
+    {
+        __m256d b0 = _mm256_loadu_pd (bp + p * LMAT_NR);
+        __m256d b1 = _mm256_loadu_pd (bp + p * LMAT_NR + 4);
+        for (int r = 0; r < LMAT_MR; r++)
+        {
+            __m256d x = _mm256_broadcast_sd (a + r * lda + p);
+            acc[r][0] = _mm256_fmadd_pd (x, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_pd (x, b1, acc[r][1]);
+        }
+    }
+
+    for (int r = 0; r < LMAT_MR; r++)
+    {
+        double *row = c + r * ldc;
+        if (nr == LMAT_NR)
+        {
+            _mm256_storeu_pd (row, _mm256_add_pd (_mm256_loadu_pd (row), acc[r][0]));
+            _mm256_storeu_pd (row + 4, _mm256_add_pd (_mm256_loadu_pd (row + 4), acc[r][1]));
+            continue;
+        }
+
+        double tile[LMAT_NR];
+        _mm256_storeu_pd (tile, acc[r][0]);
+        _mm256_storeu_pd (tile + 4, acc[r][1]);
+        for (int j = 0; j < nr; j++) row[j] += tile[j];
+    }
+}
+
+#endif
+
+/* Copies "kc" rows of "nc" columns of B into NR wide panels, padding the last with zeros */
+static void
+lmat_pack (double *bp, const double *b, int ldb, int kc, int nc)
+{
+    for (int jr = 0; jr < nc; jr += LMAT_NR)
+    {
+        double *panel = bp + (size_t) jr * kc;
+        int nr = nc - jr < LMAT_NR ? nc - jr : LMAT_NR;
+
+        for (int p = 0; p < kc; p++)
+        {
+            const double *src = b + (size_t) p * ldb + jr;
+            for (int j = 0; j < LMAT_NR; j++) panel[p * LMAT_NR + j] = j < nr ? src[j] : 0;
+        }
+    }
+}
+
+/* C = A B for an m x k A and k x n B, all row-major */
+typedef struct lmat_job
+{
+    const double *a;
+    const double *b;
+    double *c;
+    int m;
+    int n;
+    int k;
+} lmat_job;
+
+/* Computes rows of C for "part" of "parts", each thread packing B for itself */
+static void
+lmat_gemm_part (void *arg, int part, int parts)
+{
+    lmat_job *g = arg;
+    int tiles = (g->m + LMAT_MR - 1) / LMAT_MR;
+    int r0 = (int) ((long) tiles * part / parts) * LMAT_MR;
+    int r1 = (int) ((long) tiles * (part + 1) / parts) * LMAT_MR;
+    if (r1 > g->m) r1 = g->m;
+    if (r0 >= r1) return;
+
+    double *bp = malloc (sizeof (double) * LMAT_KC * (LMAT_NC + LMAT_NR));
+
+    for (int jc = 0; jc < g->n; jc += LMAT_NC)
+    {
+        int nc = g->n - jc < LMAT_NC ? g->n - jc : LMAT_NC;
+
+        for (int pc = 0; pc < g->k; pc += LMAT_KC)
+        {
+            int kc = g->k - pc < LMAT_KC ? g->k - pc : LMAT_KC;
+            lmat_pack (bp, g->b + (size_t) pc * g->n + jc, g->n, kc, nc);
+
+            for (int ic = r0; ic < r1; ic += LMAT_MC)
+            {
+                int mc = r1 - ic < LMAT_MC ? r1 - ic : LMAT_MC;
+
+                for (int jr = 0; jr < nc; jr += LMAT_NR)
+                    for (int ir = 0; ir < mc; ir += LMAT_MR)
+                        lmat_kernel (kc, g->a + (size_t) (ic + ir) * g->k + pc, g->k,
+                                     bp + (size_t) jr * kc,
+                                     g->c + (size_t) (ic + ir) * g->n + jc + jr, g->n,
+                                     mc - ir < LMAT_MR ? mc - ir : LMAT_MR,
+                                     nc - jr < LMAT_NR ? nc - jr : LMAT_NR);
+            }
+        }
+    }
+    free (bp);
+}
+
+/*
+ * A fixed set of worker threads, started on first use, that each run
+ * one part of a job alongside the calling thread. Jobs are numbered by
+ * "generation" so a worker sleeps until a new one is posted.
+ */
+#define LWORKERS_MAX 64
+#define LMAT_PARALLEL (1l << 21) // Multiply-adds below which threads cost more than they save
+
+typedef void (*lworkers_fn) (void *arg, int part, int parts);
+
+#if !defined (_WIN32)
+
+#include <pthread.h>
+#include <unistd.h>
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    int count;            // Threads besides the caller, -1 until started
+    unsigned long generation;
+    int pending;
+    lworkers_fn job;
+    void *arg;
+    int parts;
+} lworkers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .count = -1,
+};
+
+static void *
+lworkers_main (void *p)
+{
+    int id = (int) (intptr_t) p;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock (&lworkers.lock);
+    while (FOREVER)
+    {
+        while (lworkers.generation == seen) pthread_cond_wait (&lworkers.wake, &lworkers.lock);
+        seen = lworkers.generation;
+
+        lworkers_fn job = lworkers.job;
+        void *arg = lworkers.arg;
+        int parts = lworkers.parts;
+
+        pthread_mutex_unlock (&lworkers.lock);
+        if (id < parts) job (arg, id, parts);
+        pthread_mutex_lock (&lworkers.lock);
+
+        if (--lworkers.pending == 0) pthread_cond_signal (&lworkers.done);
+    }
+    return NULL;
+}
+
+/* How many parts a job can be split into, starting the workers the first time */
+int
+lworkers_size (void)
+{
+    if (lworkers.count < 0)
+    {
+        long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        lworkers.count = 0;
+
+        for (long i = 1; i < cpus && i < LWORKERS_MAX; i++)
+        {
+            pthread_t t;
+            if (pthread_create (&t, NULL, lworkers_main, (void *) (intptr_t) i) != 0) break;
+            pthread_detach (t);
+            lworkers.count++;
+        }
+    }
+    return lworkers.count + 1;
+}
+
+/* Runs job(arg, part, parts) for every part, this thread taking part 0 */
+void
+lworkers_run (lworkers_fn job, void *arg, int parts)
+{
+    if (parts <= 1 || lworkers_size () == 1)
+    {
+        for (int i = 0; i < parts; i++) job (arg, i, parts);
+        return;
+    }
+
+    pthread_mutex_lock (&lworkers.lock);
+    lworkers.job = job;
+    lworkers.arg = arg;
+    lworkers.parts = parts;
+    lworkers.pending = lworkers.count;
+    lworkers.generation++;
+    pthread_cond_broadcast (&lworkers.wake);
+    pthread_mutex_unlock (&lworkers.lock);
+
+    job (arg, 0, parts);
+
+    pthread_mutex_lock (&lworkers.lock);
+    while (lworkers.pending > 0) pthread_cond_wait (&lworkers.done, &lworkers.lock);
+    pthread_mutex_unlock (&lworkers.lock);
+}
+
+#else
+
+int
+lworkers_size (void) { return 1; }
+
+void
+lworkers_run (lworkers_fn job, void *arg, int parts)
+{
+    for (int i = 0; i < parts; i++) job (arg, i, parts);
+}
+
+#endif
+
+/* C = A B into "c", which is overwritten */
+void
+lmat_gemm (const double *a, const double *b, double *c, int m, int n, int k)
+{
+    lmat_job g = { a, b, c, m, n, k };
+    int parts = 1;
+
+    memset (c, 0, sizeof (double) * m * n);
+
+    /* Big enough products get a strip of rows per thread */
+    if ((long) m * n * k >= LMAT_PARALLEL)
+    {
+        parts = lworkers_size ();
+        if (parts > (m + LMAT_MC - 1) / LMAT_MC) parts = (m + LMAT_MC - 1) / LMAT_MC;
+    }
+    lworkers_run (lmat_gemm_part, &g, parts);
+}
+
+/* Picks the kernels for the CPU we are running on */
+void
+lvec_init (void)
+{
+#if defined (__x86_64__)
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx2"))
+    {
+        lvec_real[BUILTIN_ADD] = lvec_add_real_avx2;
+        lvec_real[BUILTIN_SUB] = lvec_sub_real_avx2;
+        lvec_real[BUILTIN_MUL] = lvec_mul_real_avx2;
+        lvec_real[BUILTIN_DIV] = lvec_div_real_avx2;
+        lvec_int[BUILTIN_ADD] = lvec_add_int_avx2;
+        lvec_int[BUILTIN_SUB] = lvec_sub_int_avx2;
+        lvec_fold[0] = lvec_sum_real_avx2;
+        lvec_fold[1] = lvec_prod_real_avx2;
+        lvec_fold[2] = lvec_min_real_avx2;
+        lvec_fold[3] = lvec_max_real_avx2;
+        lvec_dot = lvec_dot_real_avx2;
+        lvec_sum = lvec_sum_int_avx2;
+        lvec_min = lvec_min_int_avx2;
+        lvec_max = lvec_max_int_avx2;
+    }
+    else if (__builtin_cpu_supports ("sse2"))
+    {
+        lvec_real[BUILTIN_ADD] = lvec_add_real_sse2;
+        lvec_real[BUILTIN_SUB] = lvec_sub_real_sse2;
+        lvec_real[BUILTIN_MUL] = lvec_mul_real_sse2;
+        lvec_real[BUILTIN_DIV] = lvec_div_real_sse2;
+        lvec_int[BUILTIN_ADD] = lvec_add_int_sse2;
+        lvec_int[BUILTIN_SUB] = lvec_sub_int_sse2;
+        lvec_fold[0] = lvec_sum_real_sse2;
+        lvec_fold[1] = lvec_prod_real_sse2;
+        lvec_fold[2] = lvec_min_real_sse2;
+        lvec_fold[3] = lvec_max_real_sse2;
+        lvec_dot = lvec_dot_real_sse2;
+        lvec_sum = lvec_sum_int_sse2;
+    }
+
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+        lmat_kernel = lmat_kernel_avx2;
+#endif
+}
+
+/*
+ * A user defined function. Lambdas always live in the slab pool, along
+ * with everything they hold, and their lobj is shared by reference count
+ * instead of being copied. Free variables bound in the frame a lambda is created
+ * in are copied into "captured" at that point, so calling it only ever
+ * needs its own frame and the globals.
+ */
+typedef struct llambda
+{
+    int nformals;
+    int ncaptured;
+    int *names;     // Atom ids of the formals followed by the captured names
+    lval *captured;
+    lval body;
+} llambda;
+
+/*
+ * Work stack for walking lval trees on the heap instead of the C stack,
+ * so nesting depth is only bounded by memory. The first few entries live
+ * inline so shallow walks never allocate. Evaluating, folding, resolving,
+ * copying, comparing, printing and freeing all walk this way. What still
+ * bounds how deeply input can nest is mpc's recursive descent parser, as
+ * lval_read and the compilers recurse over the trees it builds using
+ * less stack per level than it does.
+ */
+#define LSTACK_INLINE 32
+
+typedef struct lwalk
+{
+    lval v;
+    int i;                 // Next child to visit
+    struct lscope *scope;  // Scope the children are resolved in, for lval_resolve
+} lwalk;
+
+typedef struct lstack
+{
+    lwalk *items;
+    int count;
+    int cap;
+    lwalk inline_items[LSTACK_INLINE];
+} lstack;
+
+void
+lstack_init (lstack *s)
+{
+    s->items = s->inline_items;
+    s->count = 0;
+    s->cap = LSTACK_INLINE;
+}
+
+/* Pushes "v" and returns its entry, invalidating earlier entry pointers */
+lwalk *
+lstack_push (lstack *s, lval v)
+{
+    if (s->count == s->cap)
+    {
+        s->cap *= 2;
+        if (s->items == s->inline_items)
+        {
+            s->items = malloc (sizeof (lwalk) * s->cap);
+            memcpy (s->items, s->inline_items, sizeof (s->inline_items));
+        }
+        else s->items = realloc (s->items, sizeof (lwalk) * s->cap);
+    }
+
+    lwalk *w = &s->items[s->count++];
+    w->v = v;
+    w->i = 0;
+    w->scope = NULL;
+    return w;
+}
+
+void
+lstack_free (lstack *s)
+{
+    if (s->items != s->inline_items) free (s->items);
+}
+
+/* Frees a node whose children have already been dealt with */
+void
+lval_free_node (lobj *o)
+{
+    switch (o->type)
+    {
+    case LVAL_DOUBLE: break;
+    case LVAL_INT: break;
+    case LVAL_BIG: lobj_free (o, o->big.limb, sizeof (uint32_t) * o->big.len); break;
+    case LVAL_FUN: break;
+    case LVAL_ERR: lobj_free (o, o->err, strlen (o->err) + 1); break;
+    case LVAL_SYM: break;
+    case LVAL_SLOT: break;
+    case LVAL_SEXPR: lobj_free (o, o->cell, sizeof (lval) * o->cap); break;
+    case LVAL_VEC: if (o->vec.len) lobj_free (o, o->vec.data, sizeof (long) * o->vec.len); break;
+    case LVAL_MAT:
+        if (o->mat.data) lobj_free (o, o->mat.data, sizeof (double) * o->mat.rows * o->mat.cols);
+        break;
+    case LVAL_LAMBDA:
+    {
+        llambda *fn = o->fn;
+        int nnames = fn->nformals + fn->ncaptured;
+        lpool_free (fn->names, sizeof (int) * nnames);
+        lpool_free (fn->captured, sizeof (lval) * fn->ncaptured);
+        lpool_free (fn, sizeof (llambda));
+        break;
+    }
+    }
+    lpool_free (o, sizeof (lobj));
+}
+
+void
+lreclaim_push (lval v);
+
+/*
+ * Frees what is queued on "s", doing at most "budget" steps of work (a
+ * child visited or a node freed) or all of it when "budget" is negative.
+ * Containers are walked with a cursor rather than having all their
+ * children pushed at once, so no single step depends on a node's size.
+ * Only nodes whose last reference has been dropped are ever queued.
+ */
+void
+lval_del_steps (lstack *s, long budget)
+{
+    for (; s->count > 0 && budget != 0; budget--)
+    {
+        lwalk *w = &s->items[s->count - 1];
+        lobj *o = lval_obj (w->v);
+        lval x;
+
+        /* Visit the children one at a time, a lambda's captures then its body */
+        if (o->type == LVAL_SEXPR && w->i < o->count)
+            x = o->cell[w->i++];
+        else if (o->type == LVAL_LAMBDA && w->i <= o->fn->ncaptured)
+        {
+            x = w->i < o->fn->ncaptured ? o->fn->captured[w->i] : o->fn->body;
+            w->i++;
+        }
+        else
+        {
+            lval_free_node (o);
+            s->count--;
+            continue;
+        }
+
+        if (lval_is_obj (x) && --lval_obj (x)->refs == 0) lstack_push (s, x);
+    }
+}
+
+/*
+ * Drops a reference to "v", freeing it once it was the last. With
+ * LISPY_RC a shared tree can be big, so one whose last reference goes
+ * is handed to the deferred reclaimer rather than walked here.
+ */
+void
+lval_del (lval v)
+{
+    /* Immediates own no memory */
+    if (!lval_is_obj (v)) return;
+
+    /* Arena objects only hold other arena objects, all reclaimed on reset */
+    if (lval_obj (v)->arena) return;
+
+    if (--lval_obj (v)->refs > 0) return;
+
+#ifdef LISPY_RC
+    if (lval_obj (v)->type == LVAL_SEXPR && lval_obj (v)->count > 0)
+    {
+        lreclaim_push (v);
+        return;
+    }
+#endif
+
+    lstack s;
+    lstack_init (&s);
+    lstack_push (&s, v);
+    lval_del_steps (&s, -1);
+    lstack_free (&s);
+}
+
+/*
+ * Deferred reclamation, for trees big enough that freeing them would
+ * stall the REPL. lval_del_later queues "v" and then, like every call
+ * to lreclaim_step, does at most lval_reclaim_budget steps of the
+ * queued work, so the pause doesn't grow with the size of the tree.
+ */
+#define LRECLAIM_BUDGET 4096
+
+static long lval_reclaim_budget = LRECLAIM_BUDGET;
+static lstack lval_reclaim;
+
+void
+lreclaim_step (void)
+{
+    if (lval_reclaim.count > 0) lval_del_steps (&lval_reclaim, lval_reclaim_budget);
+}
+
+/* Queues "v", whose last reference has been dropped */
+void
+lreclaim_push (lval v)
+{
+    if (lval_reclaim.items == NULL) lstack_init (&lval_reclaim);
+    lstack_push (&lval_reclaim, v);
+    lreclaim_step ();
+}
+
+void
+lval_del_later (lval v)
+{
+    if (!lval_is_obj (v) || lval_obj (v)->arena) return;
+    if (--lval_obj (v)->refs > 0) return;
+
+    lreclaim_push (v);
+}
+
+/* Frees everything still queued */
+void
+lreclaim_drain (void)
+{
+    if (lval_reclaim.items == NULL) return;
+
+    lval_del_steps (&lval_reclaim, -1);
+    lstack_free (&lval_reclaim);
+    lval_reclaim.items = NULL;
+}
+
+/* True when "v" can be handed out as is, taking a reference if it is shared */
+static inline bool
+lval_copy_shares (lval v)
+{
+    /* Immediates are their own copy */
+    if (!lval_is_obj (v)) return true;
+
+    lobj *o = lval_obj (v);
+
+    /* Lambdas are immutable and shared */
+    if (o->type == LVAL_LAMBDA)
+    {
+        o->refs++;
+        return true;
+    }
+
+#ifdef LISPY_RC
+    /* Everything else is shared too, unless it is being copied out of the arena */
+    if (!o->arena || lval_arena != NULL)
+    {
+        o->refs++;
+        return true;
+    }
+#endif
+    return false;
+}
+
+/* A copy of "o" alone, an sexpr's cells still holding the originals' children */
+static lobj *
+lobj_clone (lobj *o)
+{
+    lobj *x = lobj_new (o->type);
+
+    switch (o->type)
+    {
+    case LVAL_INT: x->inum = o->inum; break;
+    case LVAL_BIG:
+        x->big = o->big;
+        x->big.limb = lobj_alloc (x, sizeof (uint32_t) * o->big.len);
+        memcpy (x->big.limb, o->big.limb, sizeof (uint32_t) * o->big.len);
+        break;
+    case LVAL_VEC:
+        x->vec = o->vec;
+        x->vec.data = o->vec.len ? lobj_alloc (x, sizeof (long) * o->vec.len) : NULL;
+        if (o->vec.len) memcpy (x->vec.data, o->vec.data, sizeof (long) * o->vec.len);
+        break;
+    case LVAL_MAT:
+    {
+        size_t size = sizeof (double) * o->mat.rows * o->mat.cols;
+        x->mat = o->mat;
+        x->mat.data = size ? lobj_alloc (x, size) : NULL;
+        if (size) memcpy (x->mat.data, o->mat.data, size);
+        break;
+    }
+    case LVAL_ERR:
+        x->err = lobj_alloc (x, strlen (o->err) + 1);
+        strcpy (x->err, o->err);
+        break;
+    case LVAL_SEXPR:
+        x->count = o->count;
+        x->cap = o->count;
+        x->cell = o->count ? lobj_alloc (x, sizeof (lval) * o->count) : NULL;
+        if (o->count) memcpy (x->cell, o->cell, sizeof (lval) * o->count);
+        break;
+    default: break;
+    }
+    return x;
+}
+
+/* Deep copies "v", cloning each sexpr and then replacing its children with their copies */
+lval
+lval_copy (lval v)
+{
+    if (lval_copy_shares (v)) return v;
+
+    lval x = lval_box (lobj_clone (lval_obj (v)));
+    if (lval_type_of (x) != LVAL_SEXPR) return x;
+
+    lstack s;
+    lstack_init (&s);
+    lstack_push (&s, x);
+
+    while (s.count > 0)
+    {
+        lwalk *w = &s.items[s.count - 1];
+        lobj *o = lval_obj (w->v);
+
+        if (w->i == o->count)
+        {
+            s.count--;
+            continue;
+        }
+
+        lval *c = &o->cell[w->i++];
+        if (lval_copy_shares (*c)) continue;
+
+        *c = lval_box (lobj_clone (lval_obj (*c)));
+        if (lval_type_of (*c) == LVAL_SEXPR) lstack_push (&s, *c);
+    }
+
+    lstack_free (&s);
+    return x;
+}
+
+/* Copies "v" out of the evaluation arena so it can outlive the current line */
+lval
+lval_escape (lval v)
+{
+    larena *a = lval_arena;
+    lval_arena = NULL;
+    lval x = lval_copy (v);
+    lval_arena = a;
+    return x;
+}
+
+/* Moves "v" out of the arena if it lives there, for slots that own their value */
+static inline lval
+lval_promote (lval v)
+{
+    return lval_is_obj (v) && lval_obj (v)->arena ? lval_escape (v) : v;
+}
+
+/*
+ * Global bindings, an open-addressed table keyed on atom ids that
+ * probes from the hash the atom table already computed. Values are kept
+ * outside the arena and handed out as copies. Builtins aren't entered
+ * here, lval_read_sym already turns their names into LVAL_FUN handles.
+ */
+typedef struct lenv
+{
+    int *atoms;  // Key per slot, -1 when empty
+    lval *vals;
+    int count;
+    int nslots;  // Always a power of two
+} lenv;
+
+static inline int
+lenv_slot (lenv *e, int atom)
+{
+    size_t i = lval_atoms.atoms[atom].hash & (e->nslots - 1);
+    while (e->atoms[i] != -1 && e->atoms[i] != atom) i = (i + 1) & (e->nslots - 1);
+    return i;
+}
+
+void
+lenv_resize (lenv *e, int nslots)
+{
+    int *atoms = e->atoms;
+    lval *vals = e->vals;
+    int old = e->nslots;
+
+    e->atoms = malloc (sizeof (int) * nslots);
+    e->vals = malloc (sizeof (lval) * nslots);
+    e->nslots = nslots;
+    for (int i = 0; i < nslots; i++) e->atoms[i] = -1;
+
+    for (int i = 0; i < old; i++)
+        if (atoms[i] != -1)
+        {
+            int j = lenv_slot (e, atoms[i]);
+            e->atoms[j] = atoms[i];
+            e->vals[j] = vals[i];
+        }
+
+    free (atoms);
+    free (vals);
+}
+
+lenv *
+lenv_new (void)
+{
+    lenv *e = calloc (1, sizeof (lenv));
+    lenv_resize (e, 64);
+    return e;
+}
+
+void
+lenv_del (lenv *e)
+{
+    for (int i = 0; i < e->nslots; i++)
+        if (e->atoms[i] != -1) lval_del (e->vals[i]);
+
+    free (e->atoms);
+    free (e->vals);
+    free (e);
+}
+
+lval
+lenv_get (lenv *e, lval sym)
+{
+    int i = lenv_slot (e, lval_as_atom (sym));
+    if (e->atoms[i] == -1) return lval_err ("Unbound Symbol '%s'", lval_sym_name (sym));
+    return lval_copy (e->vals[i]);
+}
+
+/* Binds "sym" to a copy of "v" that outlives the current evaluation */
+void
+lenv_put (lenv *e, lval sym, lval v)
+{
+    int i = lenv_slot (e, lval_as_atom (sym));
+
+    if (e->atoms[i] != -1) lval_del_later (e->vals[i]);
+    else
+    {
+        e->atoms[i] = lval_as_atom (sym);
+        e->count++;
+    }
+    e->vals[i] = lval_escape (v);
+
+    if (e->count * 2 > e->nslots) lenv_resize (e, e->nslots * 2);
+}
+
+lval
+lval_read_num (mpc_ast_t *t)
+{
+    errno = 0;
+
+    if (strstr (t->contents, "."))
+    {
+        double x = strtod (t->contents, NULL);
+        return errno != ERANGE ? lval_double (x) : lval_err ("Invalid floating point number");
+    }
+    else
+    {
+        long x = strtol (t->contents, NULL, 10);
+        if (errno != ERANGE) return lval_int (x);
+
+        /* Too wide for a long, read it as a bignum */
+        lbig b = { 0 };
+        lbig_set_string (&b, t->contents);
+        lval v = lval_big (&b);
+        lbig_free (&b);
+        return v;
+    }
+}
+
+/* [numbers...], doubles if any of them has a point and longs otherwise */
+lval
+lval_read_vec (mpc_ast_t *t)
+{
+    bool real = false;
+    int n = 0;
+
+    for (int i = 0; i < t->children_num; i++)
+    {
+        if (!strstr (t->children[i]->tag, "number")) continue;
+        real |= strstr (t->children[i]->contents, ".") != NULL;
+        n++;
+    }
+
+    lval v = lval_vec (real, n);
+    lobj *o = lval_obj (v);
+    errno = 0;
+
+    for (int i = 0, j = 0; i < t->children_num; i++)
+    {
+        if (!strstr (t->children[i]->tag, "number")) continue;
+        if (real) o->vec.reals[j++] = strtod (t->children[i]->contents, NULL);
+        else o->vec.ints[j++] = strtol (t->children[i]->contents, NULL, 10);
+    }
+
+    if (errno != ERANGE) return v;
+    lval_del (v);
+    return lval_err ("Invalid vector element");
+}
+
+void
+lval_resize (lobj *o, int cap)
+{
+    if (cap == 0)
+    {
+        lobj_free (o, o->cell, sizeof (lval) * o->cap);
+        o->cell = NULL;
+    }
+    else o->cell = lobj_realloc (o, o->cell, sizeof (lval) * o->cap, sizeof (lval) * cap);
+
+    o->cap = cap;
+}
+
+/* Trims the cell array of a finished sexpr down to its count */
+lval
+lval_shrink (lval v)
+{
+    lobj *o = lval_obj (v);
+    if (o->cap > o->count) lval_resize (o, o->count);
+    return v;
+}
+
+/*
+ * Copy on write: a list with other holders is replaced by a copy of its
+ * own, in the same place as the original, before it is changed. Its
+ * children are shared with the original rather than copied.
+ */
+lval
+lval_unshare (lval v)
+{
+    lobj *o = lval_obj (v);
+    if (o->refs == 1) return v;
+
+    larena *a = lval_arena;
+    if (!o->arena) lval_arena = NULL;
+
+    lobj *x = lobj_new (LVAL_SEXPR);
+    x->count = o->count;
+    x->cap = o->count;
+    x->cell = o->count ? lobj_alloc (x, sizeof (lval) * o->count) : NULL;
+    for (int i = 0; i < o->count; i++)
+    {
+        x->cell[i] = o->cell[i];
+        if (lval_is_obj (o->cell[i])) lval_obj (o->cell[i])->refs++;
+    }
+
+    lval_arena = a;
+    o->refs--;
+    return lval_box (x);
+}
+
+lval
+lval_add (lval v, lval x)
+{
+    v = lval_unshare (v);
+    lobj *o = lval_obj (v);
+
+    /* Grow geometrically so reading n children costs O(n) */
+    if (o->count == o->cap) lval_resize (o, o->cap ? o->cap * 2 : 4);
+
+    o->cell[o->count++] = x;
+    return v;
+}
+
+lval
+lval_read_sym (mpc_ast_t *t)
+{
+    lval v = lval_sym (t->contents);
+
+    /* Operators become builtin handles so nothing downstream compares strings */
+    if (lval_as_atom (v) < BUILTIN_COUNT) return lval_fun (lval_as_atom (v));
+
+    return v;
+}
+
+lval
+lval_take (lval v, int i);
+
+lval
+lval_read (mpc_ast_t *t)
+{
+    if (strstr (t->tag, "vector")) return lval_read_vec (t);
+    if (strstr (t->tag, "number")) return lval_read_num (t);
+    if (strstr (t->tag, "symbol")) return lval_read_sym (t);
+
+    lval x = lval_sexpr ();
+
+    for (int i = 0; i< t->children_num; i++)
+    {
+        if (strcmp (t->children[i]->contents, "(") == 0) continue;
+        if (strcmp (t->children[i]->contents, ")") == 0) continue;
+        if (strcmp (t->children[i]->tag, "regex")  == 0) continue;
+        x = lval_add (x, lval_read (t->children[i]));
+    }
+
+    /* A line holding one expression is that expression, so "(f)" calls f */
+    if (strcmp (t->tag, ">") == 0 && lval_obj (x)->count == 1) return lval_take (x, 0);
+
+    return lval_shrink (x);
+}
+
+void
+lval_print (lval v);
+
+/* Prints an sexpr's opening or a lambda's up to its body, as they are entered */
+static void
+lval_print_open (lval v)
+{
+    if (lval_type_of (v) == LVAL_SEXPR)
+    {
+        putchar ('(');
+        return;
+    }
+
+    llambda *fn = lval_obj (v)->fn;
+    printf ("(lambda (");
+    for (int i = 0; i < fn->nformals; i++)
+        printf (i ? " %s" : "%s", lval_atoms.atoms[fn->names[i]].name);
+    printf (") ");
+}
+
+/*
+ * Prints sexprs and lambdas, whose bodies are walked in the same lstack
+ * as the expressions around them. A lambda's entry has one child, its
+ * body.
+ */
+void
+lval_expr_print (lval v)
+{
+    lstack s;
+    lstack_init (&s);
+    lstack_push (&s, v);
+    lval_print_open (v);
+
+    while (s.count > 0)
+    {
+        lwalk *w = &s.items[s.count - 1];
+        lobj *o = lval_obj (w->v);
+        int count = o->type == LVAL_SEXPR ? o->count : 1;
+
+        if (w->i == count)
+        {
+            putchar (')');
+            s.count--;
+            continue;
+        }
+
+        if (w->i > 0) putchar (' ');
+        lval x = o->type == LVAL_SEXPR ? o->cell[w->i] : o->fn->body;
+        w->i++;
+
+        /* Nested expressions are walked here rather than recursing */
+        if (lval_type_of (x) == LVAL_SEXPR || lval_type_of (x) == LVAL_LAMBDA)
+        {
+            lval_print_open (x);
+            lstack_push (&s, x);
+        }
+        else lval_print (x);
+    }
+
+    lstack_free (&s);
+}
+
+void
+lval_vec_print (lobj *o)
+{
+    putchar ('[');
+    for (int i = 0; i < o->vec.len; i++)
+    {
+        if (i > 0) putchar (' ');
+        if (o->vec.real) printf ("%lf", o->vec.reals[i]);
+        else printf ("%li", o->vec.ints[i]);
+    }
+    putchar (']');
+}
+
+/* Rows as nested vectors, [[a b] [c d]] */
+void
+lval_mat_print (lobj *o)
+{
+    putchar ('[');
+    for (int i = 0; i < o->mat.rows; i++)
+    {
+        printf (i > 0 ? " [" : "[");
+        for (int j = 0; j < o->mat.cols; j++)
+            printf (j > 0 ? " %lf" : "%lf", o->mat.data[(size_t) i * o->mat.cols + j]);
+        putchar (']');
+    }
+    putchar (']');
+}
+
+void
+lval_print (lval v)
+{
+    switch (lval_type_of (v))
+    {
+    case LVAL_INT    : printf ("%li", lval_as_int (v)); break;
+    case LVAL_BIG    :
+    {
+        lbig b = lval_as_big (v);
+        char *s = lbig_to_string (&b);
+        printf ("%s", s);
+        free (s);
+        break;
+    }
+    case LVAL_DOUBLE : printf ("%lf", lval_as_double (v)); break;
+    case LVAL_ERR    : printf ("%s", lval_obj (v)->err); break;
+    case LVAL_SYM    : printf ("%s", lval_sym_name (v)); break;
+    case LVAL_SLOT   : printf ("%s", lval_atoms.atoms[lval_slot_atom (v)].name); break;
+    case LVAL_FUN    : printf ("%s", builtin_names[lval_as_fun (v)]); break;
+    case LVAL_LAMBDA :
+    case LVAL_SEXPR  : lval_expr_print (v); break;
+    case LVAL_VEC    : lval_vec_print (lval_obj (v)); break;
+    case LVAL_MAT    : lval_mat_print (lval_obj (v)); break;
+    }
+}
+
+void
+lval_println (lval v) { lval_print (v); putchar ('\n'); }
+lval
+
+lval_pop (lval *v, int i)
+{
+    *v = lval_unshare (*v);
+    lobj *o = lval_obj (*v);
+
+    /* Find the item at "i" */
+    lval x = o->cell[i];
+
+    /* Shift memory after the item at "i" over the top */
+    memmove (&o->cell[i],
+             &o->cell[i + 1],
+             sizeof (lval) * (o->count -i -1));
+
+    /* Decrease the count of items in the list */
+    o->count--;
+
+    /* Only give memory back once the array is mostly empty */
+    if (o->count < o->cap / 4) lval_resize (o, o->cap / 2);
+    return x;
+}
+
+lval
+lval_take (lval v, int i)
+{
+    lval x = lval_pop (&v, i);
+    lval_del (v);
+    return x;
+}
+
+/*
+ * Applies "op" to "x" and "y" in place, or returns false when the result
+ * would not fit a long. "y" is nonzero for / and % and positive for ^.
+ */
+static bool
+lint_op (lbuiltin op, long *x, long y)
+{
+    long r;
+
+    switch (op)
+    {
+    case BUILTIN_ADD : if (__builtin_add_overflow (*x, y, &r)) return false; break;
+    case BUILTIN_SUB : if (__builtin_sub_overflow (*x, y, &r)) return false; break;
+    case BUILTIN_MUL : if (__builtin_mul_overflow (*x, y, &r)) return false; break;
+    case BUILTIN_DIV :
+        if (*x == LONG_MIN && y == -1) return false;
+        r = *x / y;
+        break;
+    case BUILTIN_MOD : r = y == -1 ? 0 : *x % y; break;
+    case BUILTIN_POW :
+    {
+        /* By squaring, bailing out as soon as either running value overflows */
+        long base = *x;
+        r = 1;
+        while (y)
+        {
+            if ((y & 1) && __builtin_mul_overflow (r, base, &r)) return false;
+            y >>= 1;
+            if (y && __builtin_mul_overflow (base, base, &base)) return false;
+        }
+        break;
+    }
+    default          : return true;
+    }
+
+    *x = r;
+    return true;
+}
+
+/* The bignum version of lint_op, returning an error message if it can't be done */
+static const char *
+lbig_op (lbuiltin op, lbig *x, const lbig *y)
+{
+    switch (op)
+    {
+    case BUILTIN_ADD : lbig_add (x, x, y, false); break;
+    case BUILTIN_SUB : lbig_add (x, x, y, true); break;
+    case BUILTIN_MUL : lbig_mul (x, x, y); break;
+    case BUILTIN_DIV : lbig_divmod (x, NULL, x, y); break;
+    case BUILTIN_MOD : lbig_divmod (NULL, x, x, y); break;
+    case BUILTIN_POW :
+    {
+        uint64_t e = y->len ? y->limb[0] : 0;
+        if (y->len == 2) e |= (uint64_t) y->limb[1] << 32;
+
+        long bits = lbig_bits (x);
+        if (bits > 1 && (y->len > 2 || e > LBIG_MAX_BITS || bits * (long) e > LBIG_MAX_BITS))
+            return "Integer too large";
+        lbig_pow (x, x, e);
+        break;
+    }
+    default          : break;
+    }
+    return NULL;
+}
+
+/*
+ * Unpacks operand "v" as "n" elements of the result's type: a vector of
+ * that type is used in place, anything else is converted or broadcast
+ * into "buf".
+ */
+static void *
+lvec_operand (lval v, bool real, int n, void *buf)
+{
+    if (lval_type_of (v) == LVAL_VEC)
+    {
+        lobj *o = lval_obj (v);
+        if (o->vec.real == real) return o->vec.data;
+
+        /* Only int vectors are ever widened */
+        for (int i = 0; i < n; i++) ((double *) buf)[i] = o->vec.ints[i];
+        return buf;
+    }
+
+    if (real)
+    {
+        double x = lval_to_double (v);
+        for (int i = 0; i < n; i++) ((double *) buf)[i] = x;
+    }
+    else
+    {
+        long x = lval_as_int (v);
+        for (int i = 0; i < n; i++) ((long *) buf)[i] = x;
+    }
+    return buf;
+}
+
+/* Integer * / % element by element, false if a result overflows */
+static bool
+lvec_int_op (lbuiltin op, long *r, const long *a, const long *b, int n)
+{
+    for (int i = 0; i < n; i++)
+        switch (op)
+        {
+        case BUILTIN_MUL : if (__builtin_mul_overflow (a[i], b[i], &r[i])) return false; break;
+        case BUILTIN_DIV :
+            if (a[i] == LONG_MIN && b[i] == -1) return false;
+            r[i] = a[i] / b[i];
+            break;
+        default          : r[i] = b[i] == -1 ? 0 : a[i] % b[i]; break;
+        }
+    return true;
+}
+
+/*
+ * "x" op "y" element-wise, where at least one is a vector and scalars are
+ * broadcast. Int results that overflow are redone in doubles, as bignums
+ * don't pack.
+ */
+lval
+lvec_op (lbuiltin op, lval x, lval y, bool real)
+{
+    int n = -1;
+    for (int k = 0; k < 2; k++)
+    {
+        lval v = k ? y : x;
+        if (lval_type_of (v) == LVAL_VEC)
+        {
+            int len = lval_obj (v)->vec.len;
+            if (n >= 0 && len != n) return lval_err ("Vector lengths %i and %i differ", n, len);
+            n = len;
+            real |= lval_obj (v)->vec.real;
+        }
+        else real |= lval_type_of (v) != LVAL_INT;
+    }
+    if (n < 0) return lval_err ("Function '%s' expects a vector", builtin_names[op]);
+
+    /* Zero divisors are errors, just as they are for scalars */
+    if (op == BUILTIN_DIV || op == BUILTIN_MOD)
+    {
+        lobj *o = lval_type_of (y) == LVAL_VEC ? lval_obj (y) : NULL;
+        for (int i = 0; i < (o ? n : 1); i++)
+            if (o ? lvec_real_at (o, i) == 0 : lval_to_double (y) == 0)
+                return lval_err ("Division By Zero");
+    }
+
+    lval v = lval_vec (real, n);
+    lobj *o = lval_obj (v);
+    void *tmp = malloc (sizeof (long) * (n ? n : 1));
+    void *a = lvec_operand (x, real, n, o->vec.data);
+    void *b = lvec_operand (y, real, n, a == o->vec.data ? tmp : o->vec.data);
+    bool over = false;
+
+    if (real)
+    {
+        if (op == BUILTIN_MOD)
+            for (int i = 0; i < n; i++)
+                o->vec.reals[i] = fmod (((double *) a)[i], ((double *) b)[i]);
+        else lvec_real[op] (o->vec.reals, a, b, n);
+    }
+    else if (op == BUILTIN_ADD || op == BUILTIN_SUB) over = lvec_int[op] (o->vec.ints, a, b, n);
+    else over = !lvec_int_op (op, o->vec.ints, a, b, n);
+
+    free (tmp);
+
+    if (!over) return v;
+    lval_del (v);
+    return lvec_op (op, x, y, true);
+}
+
+lval
+builtin_op (lbuiltin op, lval *args, int count);
+
+/* builtin_op once any of its arguments is a vector, folding left like it */
+lval
+builtin_op_vec (lbuiltin op, lval *args, int count)
+{
+    if (op == BUILTIN_POW) return lval_err ("Function '^' cannot take vectors");
+
+    for (int i = 0; i < count; i++)
+        if (!lval_is_number (args[i]) && lval_type_of (args[i]) != LVAL_VEC)
+            return lval_err("Cannnot operate on non-number!");
+
+    if (count == 1)
+        return op == BUILTIN_SUB ? lvec_op (op, lval_int (0), args[0], false) : lval_copy (args[0]);
+
+    /* Scalars ahead of the first vector fold as scalars, then get broadcast into it */
+    int first = 0;
+    while (lval_type_of (args[first]) != LVAL_VEC) first++;
+
+    int vec = first > 1 ? first : 1;
+    lval head = first > 1 ? builtin_op (op, args, first) : args[0];
+    if (lval_type_of (head) == LVAL_ERR) return head;
+
+    lval acc = lvec_op (op, head, args[vec], false);
+    if (first > 1) lval_del (head);
+
+    for (int i = vec + 1; i < count && lval_type_of (acc) != LVAL_ERR; i++)
+    {
+        lval next = lvec_op (op, acc, args[i], false);
+        lval_del (acc);
+        acc = next;
+    }
+    return acc;
+}
+
+/*
+ * Fixnums are 48 bits, so this many of them can be summed without any
+ * chance of overflowing a long and only the block sums need checking.
+ */
+#define LSUM_BLOCK 32768
+
+/*
+ * builtin_op for + - * / over arguments that are all fixnums or all
+ * doubles, which are read straight out of "args" by loops with no type
+ * tests in them. Returns false to leave anything else, or any result
+ * that overflows or divides by zero, to the general path.
+ */
+static bool
+builtin_op_fast (lbuiltin op, lval *args, int count, lval *result)
+{
+    if (count < 2 || op > BUILTIN_DIV) return false;
+
+    bool fixnums = true;
+    bool doubles = true;
+    for (int i = 0; i < count; i++)
+    {
+        fixnums &= lval_is_fixnum (args[i]);
+        doubles &= lval_is_double (args[i]);
+    }
+
+    if (doubles)
+    {
+        double x = lval_as_double (args[0]);
+        switch (op)
+        {
+        case BUILTIN_ADD : for (int i = 1; i < count; i++) x += lval_as_double (args[i]); break;
+        case BUILTIN_SUB : for (int i = 1; i < count; i++) x -= lval_as_double (args[i]); break;
+        case BUILTIN_MUL : for (int i = 1; i < count; i++) x *= lval_as_double (args[i]); break;
+        default          :
+            for (int i = 1; i < count; i++)
+            {
+                double y = lval_as_double (args[i]);
+                if (y == 0) return false;
+                x /= y;
+            }
+            break;
+        }
+        *result = lval_double (x);
+        return true;
+    }
+
+    if (!fixnums || op == BUILTIN_DIV) return false;
+
+    long x = lval_as_fixnum (args[0]);
+    if (op == BUILTIN_MUL)
+    {
+        for (int i = 1; i < count; i++)
+            if (__builtin_mul_overflow (x, lval_as_fixnum (args[i]), &x)) return false;
+    }
+    else
+    {
+        long sum = 0;
+        for (int i = 1; i < count; i += LSUM_BLOCK)
+        {
+            int end = count - i > LSUM_BLOCK ? i + LSUM_BLOCK : count;
+            long s = 0;
+            for (int j = i; j < end; j++) s += lval_as_fixnum (args[j]);
+            if (__builtin_add_overflow (sum, s, &sum)) return false;
+        }
+        if (op == BUILTIN_ADD ? __builtin_add_overflow (x, sum, &x)
+                              : __builtin_sub_overflow (x, sum, &x))
+            return false;
+    }
+    *result = lval_int (x);
+    return true;
+}
+
+/*
+ * Applies "op" to the "count" values at "args". The arguments are only
+ * read, never popped, so the caller frees them all at once afterwards.
+ */
+lval
+builtin_op (lbuiltin op, lval *args, int count)
+{
+    lval fast;
+    if (builtin_op_fast (op, args, count, &fast)) return fast;
+
+    /* Ensure all the arguments are numbers */
+    for (int i = 0; i < count; i++)
+        if (!lval_is_number (args[i]))
+        {
+            if (lval_type_of (args[i]) == LVAL_VEC) return builtin_op_vec (op, args, count);
+            return lval_err("Cannnot operate on non-number!");
+        }
+
+    /*
+     * Unbox the first element into the accumulator. Integers are worked
+     * on in "inum" until something overflows it and from then on in the
+     * bignum "big", which is "wide".
+     */
+    lval_type type = lval_type_of (args[0]) == LVAL_DOUBLE ? LVAL_DOUBLE : LVAL_INT;
+    bool wide = lval_type_of (args[0]) == LVAL_BIG;
+    long inum = type == LVAL_INT && !wide ? lval_as_int (args[0]) : 0;
+    double dnum = type == LVAL_DOUBLE ? lval_as_double (args[0]) : 0;
+    lbig big = { 0 };
+    lbig ybig = { 0 };
+    const char *err = NULL;
+
+    if (wide) lbig_set (&big, args[0]);
+
+    /* If no arguments and sub then preform unary negation */
+    if (op == BUILTIN_SUB && count == 1)
+    {
+        if (!wide && inum == LONG_MIN)
+        {
+            lbig_set_long (&big, inum);
+            wide = true;
+        }
+        if (wide) big.neg = !big.neg;
+        else inum = -inum;
+        dnum = -dnum;
+    }
+
+    /* Walk the remaining elements with a cursor */
+    for (int i = 1; i < count; i++)
+    {
+        lval y = args[i];
+        lval_type ty = lval_type_of (y);
+        bool yint = ty != LVAL_DOUBLE;
+
+        if ((op == BUILTIN_DIV || op == BUILTIN_MOD)
+            && (ty == LVAL_INT ? lval_as_int (y) == 0 : !yint && lval_as_double (y) == 0))
+        {
+            err = "Division By Zero";
+            break;
+        }
+
+        if ((type == LVAL_INT) && yint)
+        {
+            /* Negative powers truncate to zero unless the base is 1 or -1 */
+            if (op == BUILTIN_POW && (ty == LVAL_INT ? lval_as_int (y) < 0 : lval_as_big (y).neg))
+            {
+                if (!wide && inum == 0)
+                {
+                    err = "Division By Zero";
+                    break;
+                }
+
+                bool odd = ty == LVAL_INT ? lval_as_int (y) & 1 : lval_as_big (y).limb[0] & 1;
+                inum = wide || (inum != 1 && inum != -1) ? 0 : inum == -1 && odd ? -1 : 1;
+                wide = false;
+                continue;
+            }
+
+            if (!wide && ty == LVAL_INT && lint_op (op, &inum, lval_as_int (y))) continue;
+
+            /* Overflowed, or met a bignum, so carry on wide */
+            if (!wide)
+            {
+                lbig_set_long (&big, inum);
+                wide = true;
+            }
+            lbig_set (&ybig, y);
+            if ((err = lbig_op (op, &big, &ybig))) break;
+            continue;
+        }
+
+        /* A double turns the rest of the computation floating point */
+        if (type == LVAL_INT)
+        {
+            dnum = wide ? lbig_to_double (&big) : inum;
+            type = LVAL_DOUBLE;
+            wide = false;
+        }
+
+        double yd = lval_to_double (y);
+        switch (op)
+        {
+        case BUILTIN_ADD : dnum += yd; break;
+        case BUILTIN_SUB : dnum -= yd; break;
+        case BUILTIN_MUL : dnum *= yd; break;
+        case BUILTIN_DIV : dnum /= yd; break;
+        case BUILTIN_MOD : dnum = fmod (dnum, yd); break;
+        case BUILTIN_POW : dnum = pow (dnum, yd); break;
+        default          : break;
+        }
+    }
+
+    lval result = err                   ? lval_err ("%s", err)
+                : type == LVAL_DOUBLE   ? lval_double (dnum)
+                : wide                  ? lval_big (&big)
+                :                         lval_int (inum);
+    lbig_free (&big);
+    lbig_free (&ybig);
+    return result;
+}
+
+/* (def name value) binds the unevaluated symbol "name" globally */
+lval
+builtin_def (lenv *e, lval *args, int count)
+{
+    if (count != 2)
+        return lval_err ("Function 'def' passed %i arguments, expected 2", count);
+    if (lval_type_of (args[0]) != LVAL_SYM)
+        return lval_err ("Function 'def' can only define symbols");
+
+    lenv_put (e, args[0], args[1]);
+    return lval_sexpr ();
+}
+
+/* Frees the "count" values at "args" except the first error, which is returned */
+lval
+lval_first_err (lval *args, int count)
+{
+    lval err = 0;
+    bool found = false;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!found && lval_type_of (args[i]) == LVAL_ERR)
+        {
+            err = args[i];
+            found = true;
+        }
+        else lval_del (args[i]);
+    }
+    return err;
+}
+
+static inline bool
+lval_has_err (lval *args, int count)
+{
+    for (int i = 0; i < count; i++)
+        if (lval_type_of (args[i]) == LVAL_ERR) return true;
+    return false;
+}
+
+/* lval_eq for anything but two sexprs */
+static bool
+lval_eq_node (lval a, lval b)
+{
+    lval_type ta = lval_type_of (a);
+    lval_type tb = lval_type_of (b);
+
+    if (lval_is_number (a) && lval_is_number (b))
+    {
+        if (lval_is_integer (a) && lval_is_integer (b)) return lval_int_cmp (a, b) == 0;
+        return lval_to_double (a) == lval_to_double (b);
+    }
+
+    if (ta != tb) return false;
+    if (a == b) return true;
+
+    switch (ta)
+    {
+    case LVAL_ERR: return strcmp (lval_obj (a)->err, lval_obj (b)->err) == 0;
+    case LVAL_VEC:
+    {
+        lobj *x = lval_obj (a);
+        lobj *y = lval_obj (b);
+        if (x->vec.len != y->vec.len) return false;
+        for (int i = 0; i < x->vec.len; i++)
+            if (x->vec.real || y->vec.real ? lvec_real_at (x, i) != lvec_real_at (y, i)
+                                           : x->vec.ints[i] != y->vec.ints[i])
+                return false;
+        return true;
+    }
+    case LVAL_MAT:
+    {
+        lobj *x = lval_obj (a);
+        lobj *y = lval_obj (b);
+        if (x->mat.rows != y->mat.rows || x->mat.cols != y->mat.cols) return false;
+        for (size_t i = 0; i < (size_t) x->mat.rows * x->mat.cols; i++)
+            if (x->mat.data[i] != y->mat.data[i]) return false;
+        return true;
+    }
+    default: return false;
+    }
+}
+
+/*
+ * Equality across values, with ints and doubles compared numerically.
+ * Sexprs are compared child by child with the pair being walked kept as
+ * the top two entries of an lstack, the cursor on the first.
+ */
+bool
+lval_eq (lval a, lval b)
+{
+    if (lval_type_of (a) != LVAL_SEXPR || lval_type_of (b) != LVAL_SEXPR) return lval_eq_node (a, b);
+    if (lval_obj (a)->count != lval_obj (b)->count) return false;
+
+    lstack s;
+    lstack_init (&s);
+    lstack_push (&s, a);
+    lstack_push (&s, b);
+    bool eq = true;
+
+    while (eq && s.count > 0)
+    {
+        lwalk *w = &s.items[s.count - 2];
+        lobj *x = lval_obj (w->v);
+        lobj *y = lval_obj (s.items[s.count - 1].v);
+
+        if (w->i == x->count)
+        {
+            s.count -= 2;
+            continue;
+        }
+
+        lval p = x->cell[w->i];
+        lval q = y->cell[w->i];
+        w->i++;
+
+        if (lval_type_of (p) != LVAL_SEXPR || lval_type_of (q) != LVAL_SEXPR) eq = lval_eq_node (p, q);
+        else if (p == q) continue;
+        else if (lval_obj (p)->count != lval_obj (q)->count) eq = false;
+        else
+        {
+            lstack_push (&s, p);
+            lstack_push (&s, q);
+        }
+    }
+
+    lstack_free (&s);
+    return eq;
+}
+
+lval
+builtin_cmp (lbuiltin op, lval *args, int count)
+{
+    if (count != 2)
+        return lval_err ("Function '%s' passed %i arguments, expected 2", builtin_names[op], count);
+
+    if (op == BUILTIN_EQ) return lval_int (lval_eq (args[0], args[1]));
+    if (op == BUILTIN_NE) return lval_int (!lval_eq (args[0], args[1]));
+
+    for (int i = 0; i < 2; i++)
+        if (!lval_is_number (args[i]))
+            return lval_err ("Function '%s' cannot compare non-numbers", builtin_names[op]);
+
+    /* Integers compare exactly, whatever their size */
+    if (lval_is_integer (args[0]) && lval_is_integer (args[1]))
+    {
+        int c = lval_int_cmp (args[0], args[1]);
+        switch (op)
+        {
+        case BUILTIN_LT : return lval_int (c < 0);
+        case BUILTIN_GT : return lval_int (c > 0);
+        case BUILTIN_LE : return lval_int (c <= 0);
+        default         : return lval_int (c >= 0);
+        }
+    }
+
+    double x = lval_to_double (args[0]);
+    double y = lval_to_double (args[1]);
+
+    switch (op)
+    {
+    case BUILTIN_LT : return lval_int (x < y);
+    case BUILTIN_GT : return lval_int (x > y);
+    case BUILTIN_LE : return lval_int (x <= y);
+    default         : return lval_int (x >= y);
+    }
+}
+
+/* Pairwise sums of LVEC_BLOCK runs, see lvec_fold */
+double
+lvec_sum_pairwise (const double *a, int n)
+{
+    if (n <= LVEC_BLOCK) return lvec_fold[0] (a, n);
+    return lvec_sum_pairwise (a, n / 2) + lvec_sum_pairwise (a + n / 2, n - n / 2);
+}
+
+double
+lvec_dot_pairwise (const double *a, const double *b, int n)
+{
+    if (n <= LVEC_BLOCK) return lvec_dot (a, b, n);
+    return lvec_dot_pairwise (a, b, n / 2)
+         + lvec_dot_pairwise (a + n / 2, b + n / 2, n - n / 2);
+}
+
+/* An integer sum, product or dot product redone in a bignum once a long overflowed */
+static lval
+lvec_exact (lbuiltin f, lobj *a, lobj *b)
+{
+    lbig acc = { 0 };
+    lbig x = { 0 };
+    lbig y = { 0 };
+
+    lbig_set_long (&acc, f == BUILTIN_PROD);
+    for (int i = 0; i < a->vec.len; i++)
+    {
+        lbig_set_long (&x, a->vec.ints[i]);
+        if (b)
+        {
+            lbig_set_long (&y, b->vec.ints[i]);
+            lbig_mul (&x, &x, &y);
+        }
+        if (f == BUILTIN_PROD) lbig_mul (&acc, &acc, &x);
+        else lbig_add (&acc, &acc, &x, false);
+    }
+
+    lval v = lval_big (&acc);
+    lbig_free (&acc);
+    lbig_free (&x);
+    lbig_free (&y);
+    return v;
+}
+
+lval
+lvec_dot_of (lobj *a, lobj *b)
+{
+    int n = a->vec.len;
+    if (b->vec.len != n) return lval_err ("Vector lengths %i and %i differ", n, b->vec.len);
+
+    if (!a->vec.real && !b->vec.real)
+    {
+        long x = 0;
+        long p;
+        for (int i = 0; i < n; i++)
+            if (__builtin_mul_overflow (a->vec.ints[i], b->vec.ints[i], &p)
+                || __builtin_add_overflow (x, p, &x))
+                return lvec_exact (BUILTIN_DOT, a, b);
+        return lval_int (x);
+    }
+
+    /* Widen an int vector against a double one */
+    const double *x = a->vec.reals;
+    const double *y = b->vec.reals;
+    double *tmp = NULL;
+
+    if (!a->vec.real || !b->vec.real)
+    {
+        lobj *o = a->vec.real ? b : a;
+        tmp = malloc (sizeof (double) * (n ? n : 1));
+        for (int i = 0; i < n; i++) tmp[i] = o->vec.ints[i];
+        if (o == a) x = tmp;
+        else y = tmp;
+    }
+
+    double d = lvec_dot_pairwise (x, y, n);
+    free (tmp);
+    return lval_double (d);
+}
+
+/*
+ * (sum v) (prod v) (min v) (max v) (mean v) and (dot v w) over packed
+ * vectors. Integer results that overflow a long come back as bignums,
+ * like builtin_op's do.
+ */
+lval
+builtin_reduce (lbuiltin f, lval *args, int count)
+{
+    int want = f == BUILTIN_DOT ? 2 : 1;
+    if (count != want)
+        return lval_err ("Function '%s' passed %i arguments, expected %i", builtin_names[f], count, want);
+
+    for (int i = 0; i < count; i++)
+        if (lval_type_of (args[i]) != LVAL_VEC)
+            return lval_err ("Function '%s' expects a vector", builtin_names[f]);
+
+    lobj *a = lval_obj (args[0]);
+    int n = a->vec.len;
+
+    if (f == BUILTIN_DOT) return lvec_dot_of (a, lval_obj (args[1]));
+    if (n == 0 && f != BUILTIN_SUM && f != BUILTIN_PROD)
+        return lval_err ("Function '%s' passed an empty vector", builtin_names[f]);
+
+    if (a->vec.real)
+        switch (f)
+        {
+        case BUILTIN_SUM  : return lval_double (lvec_sum_pairwise (a->vec.reals, n));
+        case BUILTIN_MEAN : return lval_double (lvec_sum_pairwise (a->vec.reals, n) / n);
+        default           : return lval_double (lvec_fold[f - BUILTIN_SUM] (a->vec.reals, n));
+        }
+
+    long x = 1;
+    switch (f)
+    {
+    case BUILTIN_MIN  : return lval_int (lvec_min (a->vec.ints, n));
+    case BUILTIN_MAX  : return lval_int (lvec_max (a->vec.ints, n));
+    case BUILTIN_PROD :
+        for (int i = 0; i < n; i++)
+            if (__builtin_mul_overflow (x, a->vec.ints[i], &x)) return lvec_exact (f, a, NULL);
+        return lval_int (x);
+    default           :
+    {
+        lval sum = lvec_sum (a->vec.ints, n, &x) ? lval_int (x) : lvec_exact (BUILTIN_SUM, a, NULL);
+        if (f == BUILTIN_SUM) return sum;
+
+        double mean = lval_to_double (sum) / n;
+        lval_del (sum);
+        return lval_double (mean);
+    }
+    }
+}
+
+/* "v" when it is an int in [0, limit) for builtin "f", an error otherwise */
+static lval
+builtin_index (lbuiltin f, lval v, long limit)
+{
+    if (lval_type_of (v) != LVAL_INT) return lval_err ("Function '%s' expects integer indices", builtin_names[f]);
+    if (lval_as_int (v) < 0 || lval_as_int (v) >= limit) return lval_err ("Index %li out of range", lval_as_int (v));
+    return v;
+}
+
+/* (matrix rows cols v) reshapes the vector "v", (matrix rows cols) is all zeros */
+lval
+builtin_matrix (lval *args, int count)
+{
+    if (count != 2 && count != 3)
+        return lval_err ("Function 'matrix' passed %i arguments, expected 2 or 3", count);
+
+    if (lval_type_of (args[0]) != LVAL_INT || lval_type_of (args[1]) != LVAL_INT)
+        return lval_err ("Function 'matrix' expects integer dimensions");
+
+    long rows = lval_as_int (args[0]);
+    long cols = lval_as_int (args[1]);
+    long size;
+    if (rows < 0 || cols < 0) return lval_err ("Matrix dimensions must be non-negative");
+    if (__builtin_mul_overflow (rows, cols, &size) || size > INT_MAX)
+        return lval_err ("Matrix of %li by %li is too large", rows, cols);
+
+    lval m = lval_mat (rows, cols);
+    double *data = lval_obj (m)->mat.data;
+    int n = rows * cols;
+
+    if (count == 2)
+    {
+        if (n) memset (data, 0, sizeof (double) * n);
+        return m;
+    }
+
+    lobj *v = lval_type_of (args[2]) == LVAL_VEC ? lval_obj (args[2]) : NULL;
+    if (v == NULL || v->vec.len != n)
+    {
+        lval_del (m);
+        return lval_err ("Function 'matrix' expects a vector of %i elements", n);
+    }
+
+    if (v->vec.real) memcpy (data, v->vec.reals, sizeof (double) * n);
+    else for (int i = 0; i < n; i++) data[i] = v->vec.ints[i];
+    return m;
+}
+
+/* (matmul a b) for an m by k "a" and k by n "b" */
+lval
+builtin_matmul (lval *args, int count)
+{
+    if (count != 2) return lval_err ("Function 'matmul' passed %i arguments, expected 2", count);
+    if (lval_type_of (args[0]) != LVAL_MAT || lval_type_of (args[1]) != LVAL_MAT)
+        return lval_err ("Function 'matmul' expects matrices");
+
+    lobj *a = lval_obj (args[0]);
+    lobj *b = lval_obj (args[1]);
+    if (a->mat.cols != b->mat.rows)
+        return lval_err ("Matrix shapes %ix%i and %ix%i do not multiply",
+                         a->mat.rows, a->mat.cols, b->mat.rows, b->mat.cols);
+    if ((long) a->mat.rows * b->mat.cols > INT_MAX)
+        return lval_err ("Matrix of %i by %i is too large", a->mat.rows, b->mat.cols);
+
+    lval c = lval_mat (a->mat.rows, b->mat.cols);
+    lobj *o = lval_obj (c);
+    if (o->mat.data) lmat_gemm (a->mat.data, b->mat.data, o->mat.data, a->mat.rows, b->mat.cols, a->mat.cols);
+    return c;
+}
+
+/* (at m i j) and (at v i) read one element straight out of the buffer */
+lval
+builtin_at (lval *args, int count)
+{
+    lval_type t = count > 0 ? lval_type_of (args[0]) : LVAL_ERR;
+    int want = t == LVAL_MAT ? 3 : 2;
+
+    if (t != LVAL_MAT && t != LVAL_VEC) return lval_err ("Function 'at' expects a vector or matrix");
+    if (count != want) return lval_err ("Function 'at' passed %i arguments, expected %i", count, want);
+
+    lobj *o = lval_obj (args[0]);
+    lval i = builtin_index (BUILTIN_AT, args[1], t == LVAL_MAT ? o->mat.rows : o->vec.len);
+    if (lval_type_of (i) == LVAL_ERR) return i;
+
+    long k = lval_as_int (i);
+    if (t == LVAL_VEC) return o->vec.real ? lval_double (o->vec.reals[k]) : lval_int (o->vec.ints[k]);
+
+    lval j = builtin_index (BUILTIN_AT, args[2], o->mat.cols);
+    if (lval_type_of (j) == LVAL_ERR) return j;
+    return lval_double (o->mat.data[k * o->mat.cols + lval_as_int (j)]);
+}
+
+/* (shape m) is [rows cols], (shape v) is [len] */
+lval
+builtin_shape (lval *args, int count)
+{
+    if (count != 1) return lval_err ("Function 'shape' passed %i arguments, expected 1", count);
+
+    lval_type t = lval_type_of (args[0]);
+    if (t != LVAL_MAT && t != LVAL_VEC) return lval_err ("Function 'shape' expects a vector or matrix");
+
+    lobj *o = lval_obj (args[0]);
+    lval s = lval_vec (false, t == LVAL_MAT ? 2 : 1);
+    lobj *r = lval_obj (s);
+
+    if (t == LVAL_VEC) r->vec.ints[0] = o->vec.len;
+    else
+    {
+        r->vec.ints[0] = o->mat.rows;
+        r->vec.ints[1] = o->mat.cols;
+    }
+    return s;
+}
+
+/* Calls builtin "f" on the "count" values at "args", which stay owned by the caller */
+lval
+builtin_call (lenv *e, lbuiltin f, lval *args, int count)
+{
+    switch (f)
+    {
+    case BUILTIN_DEF    : return builtin_def (e, args, count);
+    case BUILTIN_EQ     :
+    case BUILTIN_NE     :
+    case BUILTIN_LT     :
+    case BUILTIN_GT     :
+    case BUILTIN_LE     :
+    case BUILTIN_GE     : return builtin_cmp (f, args, count);
+    case BUILTIN_IF     :
+    case BUILTIN_LAMBDA :
+    case BUILTIN_LET    : return lval_err ("Special form '%s' cannot be applied", builtin_names[f]);
+    case BUILTIN_SUM    :
+    case BUILTIN_PROD   :
+    case BUILTIN_MIN    :
+    case BUILTIN_MAX    :
+    case BUILTIN_DOT    :
+    case BUILTIN_MEAN   : return builtin_reduce (f, args, count);
+    case BUILTIN_MATRIX : return builtin_matrix (args, count);
+    case BUILTIN_MATMUL : return builtin_matmul (args, count);
+    case BUILTIN_AT     : return builtin_at (args, count);
+    case BUILTIN_SHAPE  : return builtin_shape (args, count);
+    default             : return builtin_op (f, args, count);
+    }
+}
+
+/* True when child "i" of the sexpr "o" is passed to its builtin unevaluated */
+static inline bool
+lval_is_quoted (lobj *o, int i)
+{
+    return i == 1 && (o->cell[0] == lval_fun (BUILTIN_DEF) || o->cell[0] == lval_fun (BUILTIN_LAMBDA));
+}
+
+/* The head of "o" if it is a special form that evaluates its own operands */
+static inline bool
+lval_is_special (lobj *o)
+{
+    return o->count > 0
+        && (o->cell[0] == lval_fun (BUILTIN_IF) || o->cell[0] == lval_fun (BUILTIN_LAMBDA)
+            || o->cell[0] == lval_fun (BUILTIN_LET));
+}
+
+/* True when "o" is (let ((name value)...) body) */
+bool
+lval_is_let (lobj *o)
+{
+    if (o->count != 3 || o->cell[0] != lval_fun (BUILTIN_LET)) return false;
+    if (lval_type_of (o->cell[1]) != LVAL_SEXPR) return false;
+
+    lobj *bindings = lval_obj (o->cell[1]);
+    for (int i = 0; i < bindings->count; i++)
+    {
+        if (lval_type_of (bindings->cell[i]) != LVAL_SEXPR) return false;
+
+        lobj *b = lval_obj (bindings->cell[i]);
+        if (b->count != 2 || lval_type_of (b->cell[0]) != LVAL_SYM) return false;
+    }
+    return true;
+}
+
+/* The value expression of binding "i" in a let */
+static inline lval
+lval_let_value (lobj *o, int i) { return lval_obj (lval_obj (o->cell[1])->cell[i])->cell[1]; }
+
+/*
+ * Local bindings, of one lambda call or one let, read through the slots
+ * lval_resolve gave their symbols. A lambda's frame holds its arguments
+ * and reaches its captured values through "fn", a let's frame holds its
+ * values and hangs off the frame it was made in.
+ */
+typedef struct lframe
+{
+    struct lframe *parent; // NULL for a lambda's frame
+    lval fn;               // The lambda, holding a reference, or 0 for a let
+    lval *vals;
+    int count;
+    int cap;
+} lframe;
+
+/* The value of the local "slot", "depth" frames out from "f" */
+static inline lval
+lframe_get (lframe *f, lval slot)
+{
+    for (int d = lval_slot_depth (slot); d > 0; d--)
+        f = f->parent;
+
+    int i = lval_slot_index (slot);
+    if (i < f->count) return lval_copy (f->vals[i]);
+    return lval_copy (lval_obj (f->fn)->fn->captured[i - f->count]);
+}
+
+/* Binds "count" values to the frame for "fn", taking ownership of both */
+void
+lframe_bind (lframe *f, lval fn, lval *args, int count)
+{
+    for (int i = 0; i < f->count; i++)
+        lval_del (f->vals[i]);
+
+    if (count > f->cap)
+    {
+        f->vals = lpool_realloc (f->vals, sizeof (lval) * f->cap, sizeof (lval) * count);
+        f->cap = count;
+    }
+
+    if (count > 0) memcpy (f->vals, args, sizeof (lval) * count);
+    f->count = count;
+
+    /* Released last, the old lambda may be the one being bound again */
+    lval old = f->fn;
+    f->fn = fn;
+    lval_del (old);
+}
+
+lframe *
+lframe_new (lframe *parent, lval fn, lval *args, int count)
+{
+    lframe *f = lpool_alloc (sizeof (lframe));
+    f->parent = parent;
+    f->fn = 0;
+    f->vals = NULL;
+    f->count = 0;
+    f->cap = 0;
+    lframe_bind (f, fn, args, count);
+    return f;
+}
+
+void
+lframe_free (lframe *f)
+{
+    for (int i = 0; i < f->count; i++)
+        lval_del (f->vals[i]);
+
+    lval_del (f->fn);
+    lpool_free (f->vals, sizeof (lval) * f->cap);
+    lpool_free (f, sizeof (lframe));
+}
+
+void
+lframe_promote (lframe *f)
+{
+    for (int i = 0; i < f->count; i++)
+        f->vals[i] = lval_promote (f->vals[i]);
+}
+
+/* Value of anything that isn't an sexpr, which leaves "x" alone */
+static inline lval
+lval_eval_atom (lenv *e, lframe *f, lval x)
+{
+    switch (lval_type_of (x))
+    {
+    case LVAL_SYM  : return lenv_get (e, x);
+    case LVAL_SLOT : return lframe_get (f, x);
+    default        : return lval_copy (x);
+    }
+}
+
+/*
+ * (lambda (formals...) body captures) evaluated in frame "f", where
+ * "captures" is the list of slots lval_resolve found the body using from
+ * the enclosing scopes. Only lval_resolve adds it, rejecting lambdas
+ * written with four cells.
+ */
+lval
+lval_lambda (lframe *f, lval form)
+{
+    lobj *o = lval_obj (form);
+
+    if ((o->count != 3 && o->count != 4) || lval_type_of (o->cell[1]) != LVAL_SEXPR)
+        return lval_err ("Function 'lambda' expects a list of formals and a body");
+
+    lobj *formals = lval_obj (o->cell[1]);
+    for (int i = 0; i < formals->count; i++)
+        if (lval_type_of (formals->cell[i]) != LVAL_SYM)
+            return lval_err ("Function 'lambda' can only take symbols as formals");
+
+    lobj *captures = NULL;
+    if (o->count == 4)
+    {
+        if (lval_type_of (o->cell[3]) != LVAL_SEXPR)
+            return lval_err ("Function 'lambda' expects a list of formals and a body");
+
+        captures = lval_obj (o->cell[3]);
+        for (int i = 0; i < captures->count; i++)
+            if (lval_type_of (captures->cell[i]) != LVAL_SLOT)
+                return lval_err ("Function 'lambda' expects a list of formals and a body");
+    }
+
+    /* Lambdas always go to the pool, whatever the arena is doing */
+    larena *arena = lval_arena;
+    lval_arena = NULL;
+
+    llambda *fn = lpool_alloc (sizeof (llambda));
+    fn->nformals = formals->count;
+    fn->ncaptured = captures ? captures->count : 0;
+    fn->names = lpool_alloc (sizeof (int) * (fn->nformals + fn->ncaptured));
+    fn->captured = fn->ncaptured ? lpool_alloc (sizeof (lval) * fn->ncaptured) : NULL;
+    fn->body = lval_copy (o->cell[2]);
+
+    for (int i = 0; i < fn->nformals; i++)
+        fn->names[i] = lval_as_atom (formals->cell[i]);
+
+    for (int i = 0; i < fn->ncaptured; i++)
+    {
+        fn->names[fn->nformals + i] = lval_slot_atom (captures->cell[i]);
+        fn->captured[i] = lframe_get (f, captures->cell[i]);
+    }
+
+    lobj *l = lobj_new (LVAL_LAMBDA);
+    l->fn = fn;
+    lval_arena = arena;
+    return lval_box (l);
+}
+
+/* Truth as seen by if: zero and the empty expression are false */
+bool
+lval_truthy (lval v)
+{
+    switch (lval_type_of (v))
+    {
+    case LVAL_INT    : return lval_as_int (v) != 0;
+    case LVAL_DOUBLE : return lval_as_double (v) != 0;
+    case LVAL_SEXPR  : return lval_obj (v)->count > 0;
+    case LVAL_VEC    : return lval_obj (v)->vec.len > 0;
+    default          : return true;
+    }
+}
+
+/*
+ * The evaluator works from two explicit stacks: one entry per sexpr
+ * being evaluated and the values its children evaluated to. Expressions
+ * are only read, never modified, so lambda bodies run straight from the
+ * lambda. Forms in tail position (the chosen branch of an if, the body
+ * of a let or a lambda) replace the entry they came from rather than
+ * pushing a new one, and a lambda call in that position reuses the frame
+ * of the entry it replaces, so tail recursion runs in constant space.
+ *
+ * Temporaries are bump allocated past a mark in the current arena, the
+ * evaluator's nursery. Once LEVAL_NURSERY bytes have gone there, a minor
+ * collection promotes whatever the value stack and frames still hold to
+ * the pool and rewinds the nursery, so the garbage of a long running
+ * loop is dropped without being looked at. The result is left in the
+ * arena with the rest of the last window, for the caller's arena to drop.
+ *
+ * Promotion copies, as values in the nursery can't be moved out of it:
+ * each arena value still live at a collection is copied to the pool once,
+ * buffers of vectors and matrices included, and then stays there. Pool
+ * values aren't copied again, and under LISPY_RC neither are the pool
+ * children of a promoted list, which are shared. Without LISPY_RC every
+ * read of a binding is already a copy into the arena, so a large vector
+ * carried through a loop costs one more copy per collection it is live at.
+ */
+typedef struct lentry
+{
+    lval expr;      // Borrowed, never modified
+    int i;          // Next operand to evaluate
+    int limit;      // How many operands are evaluated before applying
+    int base;       // Where the evaluated operands start on the value stack
+    lframe *frame;  // Local bindings, NULL at the top level
+    lframe *outer;  // The frame the entry was given, those above it are its own
+} lentry;
+
+#define LEVAL_INLINE 32
+#define LEVAL_NURSERY (256 * 1024)
+
+typedef struct leval
+{
+    lentry *entries;
+    int nentries;
+    int entcap;
+    lval *vals;
+    int nvals;
+    int valcap;
+    lentry entry_buf[LEVAL_INLINE];
+    lval val_buf[LEVAL_INLINE];
+} leval;
+
+/* How many operands of "o" are evaluated before it is applied */
+int
+lval_operands (lobj *o)
+{
+    if (!lval_is_special (o)) return o->count;
+
+    /* An if only evaluates its condition up front, a let its values */
+    if (o->cell[0] == lval_fun (BUILTIN_IF)) return o->count > 1 ? 2 : 0;
+    if (o->cell[0] == lval_fun (BUILTIN_LET)) return lval_is_let (o) ? lval_obj (o->cell[1])->count : 0;
+    return 0;
+}
+
+/* Points "w" at "expr", which is evaluated from its first operand */
+static inline void
+lentry_start (lentry *w, lval expr)
+{
+    w->expr = expr;
+    w->i = 0;
+    w->limit = lval_operands (lval_obj (expr));
+}
+
+/* Frees the frames "w" made for itself */
+static inline void
+lentry_release (lentry *w)
+{
+    while (w->frame != w->outer)
+    {
+        lframe *parent = w->frame->parent;
+        lframe_free (w->frame);
+        w->frame = parent;
+    }
+}
+
+lentry *
+leval_enter (leval *s, lval expr, lframe *f)
+{
+    if (s->nentries == s->entcap)
+    {
+        s->entcap *= 2;
+        if (s->entries == s->entry_buf)
+        {
+            s->entries = malloc (sizeof (lentry) * s->entcap);
+            memcpy (s->entries, s->entry_buf, sizeof (s->entry_buf));
+        }
+        else s->entries = realloc (s->entries, sizeof (lentry) * s->entcap);
+    }
+
+    lentry *w = &s->entries[s->nentries++];
+    w->base = s->nvals;
+    w->frame = f;
+    w->outer = f;
+    lentry_start (w, expr);
+    return w;
+}
+
+void
+leval_push (leval *s, lval v)
+{
+    if (s->nvals == s->valcap)
+    {
+        s->valcap *= 2;
+        if (s->vals == s->val_buf)
+        {
+            s->vals = malloc (sizeof (lval) * s->valcap);
+            memcpy (s->vals, s->val_buf, sizeof (s->val_buf));
+        }
+        else s->vals = realloc (s->vals, sizeof (lval) * s->valcap);
+    }
+    s->vals[s->nvals++] = v;
+}
+
+/* Moves every value the evaluator still holds out of the nursery */
+void
+leval_collect (leval *s)
+{
+    for (int i = 0; i < s->nvals; i++)
+        s->vals[i] = lval_promote (s->vals[i]);
+
+    for (int i = 0; i < s->nentries; i++)
+        for (lframe *g = s->entries[i].frame; g != s->entries[i].outer; g = g->parent)
+            lframe_promote (g);
+}
+
+/* Evaluates "expr" with locals from "f", leaving "expr" untouched */
+lval
+lval_eval_in (lenv *e, lframe *f, lval expr)
+{
+    if (lval_type_of (expr) != LVAL_SEXPR) return lval_eval_atom (e, f, expr);
+
+    leval s = { .entcap = LEVAL_INLINE, .valcap = LEVAL_INLINE };
+    s.entries = s.entry_buf;
+    s.vals = s.val_buf;
+    leval_enter (&s, expr, f);
+
+    larena *nursery = lval_arena;
+    lmark mark = nursery ? larena_mark (nursery) : (lmark) { NULL, 0 };
+    size_t collected = nursery ? nursery->allocated : 0;
+
+    for (;;)
+    {
+        if (nursery != NULL && nursery->allocated - collected > LEVAL_NURSERY)
+        {
+            leval_collect (&s);
+            larena_rewind (nursery, mark);
+            collected = nursery->allocated;
+            lreclaim_step ();
+        }
+
+        lentry *w = &s.entries[s.nentries - 1];
+        lobj *o = lval_obj (w->expr);
+        lval result;
+
+        /* Evaluate the next operand, descending into expressions */
+        if (w->i < w->limit)
+        {
+            lval x = o->cell[0] == lval_fun (BUILTIN_LET) ? lval_let_value (o, w->i) : o->cell[w->i];
+
+            if (lval_is_quoted (o, w->i)) leval_push (&s, lval_copy (x));
+            else if (lval_type_of (x) == LVAL_SEXPR)
+            {
+                leval_enter (&s, x, w->frame);
+                continue;
+            }
+            else leval_push (&s, lval_eval_atom (e, w->frame, x));
+
+            w->i++;
+            continue;
+        }
+
+        lval *args = s.vals + w->base;
+        int count = s.nvals - w->base;
+
+        if (lval_has_err (args, count)) result = lval_first_err (args, count);
+
+        /* Empty Expression */
+        else if (o->count == 0) result = lval_copy (w->expr);
+
+        else if (o->cell[0] == lval_fun (BUILTIN_LAMBDA))
+            result = lval_lambda (w->frame, w->expr);
+
+        else if (o->cell[0] == lval_fun (BUILTIN_IF))
+        {
+            if (o->count < 3 || o->count > 4)
+            {
+                for (int i = 0; i < count; i++) lval_del (args[i]);
+                result = lval_err ("Function 'if' expects a condition and one or two branches");
+            }
+            else
+            {
+                int branch = lval_truthy (args[1]) ? 2 : 3;
+                for (int i = 0; i < count; i++) lval_del (args[i]);
+                s.nvals = w->base;
+
+                /* The branch is in tail position, it takes over this entry */
+                if (branch < o->count && lval_type_of (o->cell[branch]) == LVAL_SEXPR)
+                {
+                    lentry_start (w, o->cell[branch]);
+                    continue;
+                }
+
+                result = branch < o->count ? lval_eval_atom (e, w->frame, o->cell[branch]) : lval_sexpr ();
+            }
+        }
+
+        else if (o->cell[0] == lval_fun (BUILTIN_LET))
+        {
+            if (!lval_is_let (o))
+                result = lval_err ("Function 'let' expects a list of (name value) bindings and a body");
+            else
+            {
+                /* The values become a frame, and the body runs in this entry */
+                w->frame = lframe_new (w->frame, 0, args, count);
+                s.nvals = w->base;
+
+                if (lval_type_of (o->cell[2]) == LVAL_SEXPR)
+                {
+                    lentry_start (w, o->cell[2]);
+                    continue;
+                }
+                result = lval_eval_atom (e, w->frame, o->cell[2]);
+            }
+        }
+
+        /* Single Expression, unless it calls a lambda with no arguments */
+        else if (count == 1 && lval_type_of (args[0]) != LVAL_LAMBDA) result = args[0];
+
+        else if (lval_type_of (args[0]) == LVAL_FUN)
+        {
+            result = builtin_call (e, lval_as_fun (args[0]), args + 1, count - 1);
+            for (int i = 0; i < count; i++) lval_del (args[i]);
+        }
+
+        else if (lval_type_of (args[0]) == LVAL_LAMBDA)
+        {
+            llambda *fn = lval_obj (args[0])->fn;
+
+            if (count - 1 != fn->nformals)
+            {
+                result = lval_err ("Function passed %i arguments, expected %i", count - 1, fn->nformals);
+                for (int i = 0; i < count; i++) lval_del (args[i]);
+            }
+            else
+            {
+                /* Tail call: drop this entry's frames but one, and rebind it */
+                if (w->frame != w->outer)
+                {
+                    while (w->frame->parent != w->outer)
+                    {
+                        lframe *parent = w->frame->parent;
+                        lframe_free (w->frame);
+                        w->frame = parent;
+                    }
+                    lframe_bind (w->frame, args[0], args + 1, count - 1);
+                    w->frame->parent = NULL;
+                }
+                else w->frame = lframe_new (NULL, args[0], args + 1, count - 1);
+
+                w->outer = NULL;
+                s.nvals = w->base;
+
+                if (lval_type_of (fn->body) == LVAL_SEXPR)
+                {
+                    lentry_start (w, fn->body);
+                    continue;
+                }
+                result = lval_eval_atom (e, w->frame, fn->body);
+            }
+        }
+
+        else
+        {
+            for (int i = 0; i < count; i++) lval_del (args[i]);
+            result = lval_err("S-expression Does not start with symbol!");
+        }
+
+        /* Hand the result to the parent */
+        s.nvals = w->base;
+        lentry_release (w);
+        s.nentries--;
+
+        if (s.nentries == 0)
+        {
+            if (s.entries != s.entry_buf) free (s.entries);
+            if (s.vals != s.val_buf) free (s.vals);
+            return result;
+        }
+
+        leval_push (&s, result);
+        s.entries[s.nentries - 1].i++;
+    }
+}
+
+lval
+lval_eval (lenv *e, lval v)
+{
+    lval result = lval_eval_in (e, NULL, v);
+    lval_del (v);
+    return result;
+}
+
+/* Applies the function "fn" to "count" arguments, consuming all of them */
+lval
+lval_call (lenv *e, lval fn, lval *args, int count)
+{
+    lval result;
+
+    if (lval_type_of (fn) == LVAL_FUN)
+    {
+        result = builtin_call (e, lval_as_fun (fn), args, count);
+        for (int i = 0; i < count; i++) lval_del (args[i]);
+        return result;
+    }
+
+    if (lval_type_of (fn) != LVAL_LAMBDA)
+    {
+        for (int i = 0; i < count; i++) lval_del (args[i]);
+        lval_del (fn);
+        return lval_err("S-expression Does not start with symbol!");
+    }
+
+    llambda *l = lval_obj (fn)->fn;
+    if (count != l->nformals)
+    {
+        result = lval_err ("Function passed %i arguments, expected %i", count, l->nformals);
+        for (int i = 0; i < count; i++) lval_del (args[i]);
+        lval_del (fn);
+        return result;
+    }
+
+    lframe *f = lframe_new (NULL, fn, args, count);
+    result = lval_eval_in (e, f, l->body);
+    lframe_free (f);
+    return result;
+}
+
+/* Folds the sexpr "v" itself, its children having been folded already */
+static lval
+lval_fold_node (lval v)
+{
+    lobj *o = lval_obj (v);
+
+    /* A single symbol or expression might still be a lambda to call */
+    if (o->count == 1 && lval_type_of (o->cell[0]) != LVAL_SYM
+        && lval_type_of (o->cell[0]) != LVAL_SEXPR && !lval_is_special (o))
+        return lval_take (v, 0);
+    if (o->count == 0 || lval_type_of (o->cell[0]) != LVAL_FUN) return v;
+    if (!builtin_is_op (lval_as_fun (o->cell[0]))) return v;
+
+    for (int i = 1; i < o->count; i++)
+        if (!lval_is_number (o->cell[i])) return v;
+
+    lval result = builtin_op (lval_as_fun (o->cell[0]), o->cell + 1, o->count - 1);
+    lval_del (v);
+    return result;
+}
+
+/*
+ * Folds every builtin call whose arguments are all number literals into
+ * the value builtin_op gives for it, errors included, since an error
+ * literal evaluates the same way the failing call would. Single
+ * expressions are replaced by their child when it is a literal. The tree
+ * is walked bottom up in an lstack, each folded node being written back
+ * into the cell of its parent the cursor just passed. Consumes "v".
+ */
+lval
+lval_fold (lval v)
+{
+    if (lval_type_of (v) != LVAL_SEXPR) return v;
+
+    lstack s;
+    lstack_init (&s);
+    lstack_push (&s, v);
+
+    while (FOREVER)
+    {
+        lwalk *w = &s.items[s.count - 1];
+        lobj *o = lval_obj (w->v);
+
+        if (w->i < o->count)
+        {
+            int i = w->i++;
+            if (!lval_is_quoted (o, i) && lval_type_of (o->cell[i]) == LVAL_SEXPR)
+                lstack_push (&s, o->cell[i]);
+            continue;
+        }
+
+        lval folded = lval_fold_node (w->v);
+        if (--s.count == 0)
+        {
+            v = folded;
+            break;
+        }
+
+        w = &s.items[s.count - 1];
+        lval_obj (w->v)->cell[w->i - 1] = folded;
+    }
+
+    lstack_free (&s);
+    return v;
+}
+
+/*
+ * Scopes seen by lval_resolve, innermost first, each naming the slots of
+ * the frame it makes at runtime. A lambda's scope ends the chain its body
+ * sees: names it uses from further out are added to it as captures, and
+ * the slots they come from are listed on the lambda form for lval_lambda.
+ */
+typedef struct lscope
+{
+    struct lscope *up;
+    lobj *lambda; // The lambda form, NULL for a let
+    lobj *form;   // The lambda or let that made it
+    int depth;    // Scopes between this one and the lambda it is in
+    int *names;
+    int count;
+    int cap;
+} lscope;
+
+void
+lscope_add (lscope *s, int atom)
+{
+    if (s->count == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 8;
+        s->names = realloc (s->names, sizeof (int) * s->cap);
+    }
+    s->names[s->count++] = atom;
+}
+
+/* The index of "atom" in "s", or -1 */
+static int
+lscope_index (lscope *s, int atom)
+{
+    for (int i = 0; i < s->count; i++)
+        if (s->names[i] == atom) return i;
+    return -1;
+}
+
+/* Scopes from "from" out to "to" */
+static int
+lscope_depth (lscope *from, lscope *to)
+{
+    int depth = 0;
+    for (; from != to; from = from->up) depth++;
+    return depth;
+}
+
+/* A slot, or an error when it doesn't fit the fields lval_slot packs */
+static lval
+lscope_slot (int depth, int index, int atom)
+{
+    if (depth > 0xFF || index > 0xFFFF || atom > 0xFFFFFF)
+        return lval_err ("Too many locals to address '%s'", lval_atoms.atoms[atom].name);
+    return lval_slot (depth, index, atom);
+}
+
+/* The slot "atom" is in as seen from "s", 0 for a global, or an error */
+lval
+lscope_find (lscope *s, int atom)
+{
+    lscope **lambdas = NULL;
+    int crossed = 0;
+    lscope *c = s;
+
+    /* Walk out to the scope binding it, noting the lambdas that have to capture it */
+    for (; c != NULL && lscope_index (c, atom) < 0; c = c->up)
+        if (c->lambda != NULL)
+        {
+            lambdas = realloc (lambdas, sizeof (lscope *) * (crossed + 1));
+            lambdas[crossed++] = c;
+        }
+
+    if (c == NULL)
+    {
+        free (lambdas);
+        return 0;
+    }
+
+    /* Each capture is taken from the slot the lambda outside it got, the outermost first */
+    int index = lscope_index (c, atom);
+    for (int k = crossed - 1; k >= 0; k--)
+    {
+        lscope *l = lambdas[k];
+        lval outer = lscope_slot (lscope_depth (l->up, c), index, atom);
+        if (lval_type_of (outer) == LVAL_ERR)
+        {
+            free (lambdas);
+            return outer;
+        }
+
+        l->lambda->cell[3] = lval_add (l->lambda->cell[3], outer);
+        lscope_add (l, atom);
+        c = l;
+        index = l->count - 1;
+    }
+
+    free (lambdas);
+    return lscope_slot (lscope_depth (s, c), index, atom);
+}
+
+/* True when "o" is (lambda (formals...) body) as read, before any captures are added */
+static bool
+lval_is_lambda_form (lobj *o)
+{
+    if (o->count != 3 || o->cell[0] != lval_fun (BUILTIN_LAMBDA) || lval_type_of (o->cell[1]) != LVAL_SEXPR)
+        return false;
+
+    lobj *formals = lval_obj (o->cell[1]);
+    for (int i = 0; i < formals->count; i++)
+        if (lval_type_of (formals->cell[i]) != LVAL_SYM) return false;
+    return true;
+}
+
+/*
+ * Pushes the sexpr "x", seen from scope "s", for lval_resolve. A lambda
+ * or let gets the scope it makes, which its entry owns, anything else
+ * the one it is in. Returns "x", or an error in its place.
+ */
+static lval
+lval_resolve_enter (lstack *st, lscope *s, lval x)
+{
+    lobj *o = lval_obj (x);
+    lscope *inner = NULL;
+
+    /* The captures list is only ever added here, never written by hand */
+    if (o->count > 0 && o->cell[0] == lval_fun (BUILTIN_LAMBDA) && o->count != 3)
+    {
+        lval_del (x);
+        return lval_err ("Function 'lambda' expects a list of formals and a body");
+    }
+
+    if (lval_is_lambda_form (o))
+    {
+        if (lval_obj (o->cell[1])->count > 0xFFFF)
+        {
+            lval_del (x);
+            return lval_err ("Function 'lambda' passed too many formals");
+        }
+
+        x = lval_add (x, lval_sexpr ());
+        o = lval_obj (x);
+
+        lobj *formals = lval_obj (o->cell[1]);
+        inner = calloc (1, sizeof (lscope));
+        *inner = (lscope) { s, o, o, 0, NULL, 0, 0 };
+        for (int i = 0; i < formals->count; i++)
+            lscope_add (inner, lval_as_atom (formals->cell[i]));
+    }
+    else if (lval_is_let (o))
+    {
+        lobj *bindings = lval_obj (o->cell[1]);
+        int depth = s ? s->depth + 1 : 0;
+
+        if (depth > 0xFF || bindings->count > 0xFFFF)
+        {
+            lval_del (x);
+            return lval_err ("Function 'let' nested too deeply");
+        }
+
+        /* The values are resolved outside the let, its names only bind in the body */
+        inner = calloc (1, sizeof (lscope));
+        *inner = (lscope) { s, NULL, o, depth, NULL, 0, 0 };
+        for (int i = 0; i < bindings->count; i++)
+            lscope_add (inner, lval_as_atom (lval_obj (bindings->cell[i])->cell[0]));
+    }
+
+    lstack_push (st, x)->scope = inner ? inner : s;
+    return x;
+}
+
+/*
+ * Child "i" of the node "w" is resolving, and the scope it is resolved
+ * in, or NULL once there are no more. A lambda's only child is its body,
+ * a let's are its values and then its body.
+ */
+static lval *
+lval_resolve_cell (lwalk *w, int i, lscope **scope, bool *quoted)
+{
+    lobj *o = lval_obj (w->v);
+    lscope *s = w->scope;
+
+    *scope = s;
+    *quoted = false;
+
+    if (s != NULL && s->form == o && s->lambda != NULL) return i == 0 ? &o->cell[2] : NULL;
+
+    if (s != NULL && s->form == o)
+    {
+        lobj *bindings = lval_obj (o->cell[1]);
+        if (i == bindings->count) return &o->cell[2];
+        if (i > bindings->count) return NULL;
+
+        *scope = s->up;
+        return &lval_obj (bindings->cell[i])->cell[1];
+    }
+
+    if (i >= o->count) return NULL;
+    *quoted = lval_is_quoted (o, i);
+    return &o->cell[i];
+}
+
+/* Frees the scope "w" made, if it is a lambda's or a let's */
+static void
+lval_resolve_leave (lwalk *w)
+{
+    if (w->scope == NULL || w->scope->form != lval_obj (w->v)) return;
+
+    free (w->scope->names);
+    free (w->scope);
+}
+
+/*
+ * Rewrites every symbol bound by an enclosing lambda or let into the
+ * slot it will be found at, so locals are read straight out of their
+ * frame and only globals go to the environment. Sexprs are walked in an
+ * lstack whose entries carry the scope they are in. A local that can't
+ * be given a slot makes the whole expression an error. Consumes "v".
+ */
+lval
+lval_resolve (lval v)
+{
+    if (lval_type_of (v) != LVAL_SEXPR) return v;
+
+    lstack st;
+    lstack_init (&st);
+    v = lval_resolve_enter (&st, NULL, v);
+
+    while (st.count > 0)
+    {
+        lwalk *w = &st.items[st.count - 1];
+        lscope *s;
+        bool quoted;
+        lval *c = lval_resolve_cell (w, w->i++, &s, &quoted);
+
+        if (c == NULL)
+        {
+            lval_resolve_leave (w);
+            st.count--;
+            continue;
+        }
+        if (quoted) continue;
+
+        if (lval_type_of (*c) == LVAL_SEXPR) *c = lval_resolve_enter (&st, s, *c);
+        else if (lval_type_of (*c) == LVAL_SYM)
+        {
+            lval slot = lscope_find (s, lval_as_atom (*c));
+            if (lval_type_of (slot) == LVAL_ERR)
+            {
+                while (st.count > 0) lval_resolve_leave (&st.items[--st.count]);
+                lstack_free (&st);
+                lval_del (v);
+                return slot;
+            }
+
+            /* Capturing can grow the cells "c" points into, so it is found again */
+            if (slot != 0) *lval_resolve_cell (w, w->i - 1, &s, &quoted) = slot;
+        }
+    }
+
+    lstack_free (&st);
+    return v;
+}
+
+/*
+ * Bytecode for a read expression. Compiling leaves the lval tree alone,
+ * so the same lcode can be run any number of times. Each instruction
+ * works on a value stack that is sized at compile time, which means
+ * running literal arithmetic allocates nothing.
+ */
+typedef enum
+{
+    OP_CONST,  // Push consts[arg]
+    OP_GLOBAL, // Push the global bound to the symbol consts[arg]
+    OP_CALL,   // Apply builtin "fun" to the top "arg" values
+    OP_APPLY,  // Apply the evaluated sexpr in the top "arg" values
+    OP_EVAL,   // Push the value of the special form consts[arg]
+    OP_RETURN
+} lopcode;
+
+typedef struct linsn
+{
+    uint16_t op;
+    uint16_t fun;
+    int32_t arg;
+} linsn;
+
+typedef struct lcode
+{
+    linsn *code;
+    int count;
+    int cap;
+    lval *consts;
+    int nconsts;
+    int constcap;
+    int depth;     // Stack depth while compiling
+    int max_depth;
+    lval *stack;
+} lcode;
+
+void
+lcode_emit (lcode *c, lopcode op, int fun, int arg, int effect)
+{
+    if (c->count == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->code = realloc (c->code, sizeof (linsn) * c->cap);
+    }
+    c->code[c->count++] = (linsn) { op, fun, arg };
+
+    c->depth += effect;
+    if (c->depth > c->max_depth) c->max_depth = c->depth;
+}
+
+void
+lcode_const (lcode *c, lopcode op, lval v)
+{
+    if (c->nconsts == c->constcap)
+    {
+        c->constcap = c->constcap ? c->constcap * 2 : 16;
+        c->consts = realloc (c->consts, sizeof (lval) * c->constcap);
+    }
+
+    /* The constant table owns its own copy of anything on the heap */
+    c->consts[c->nconsts] = lval_copy (v);
+    lcode_emit (c, op, 0, c->nconsts++, 1);
+}
+
+void
+lcode_expr (lcode *c, lval v)
+{
+    if (lval_type_of (v) == LVAL_SYM)
+    {
+        lcode_const (c, OP_GLOBAL, v);
+        return;
+    }
+    if (lval_type_of (v) != LVAL_SEXPR)
+    {
+        lcode_const (c, OP_CONST, v);
+        return;
+    }
+
+    lobj *o = lval_obj (v);
+
+    /* if and lambda are left to the evaluator, which can call in tail position */
+    if (lval_is_special (o))
+    {
+        lcode_const (c, OP_EVAL, v);
+        return;
+    }
+
+    /* Empty and single expressions evaluate to themselves and their child */
+    if (o->count == 0)
+    {
+        lcode_const (c, OP_CONST, v);
+        return;
+    }
+    if (o->count == 1 && lval_type_of (o->cell[0]) != LVAL_SYM
+        && lval_type_of (o->cell[0]) != LVAL_SEXPR)
+    {
+        lcode_expr (c, o->cell[0]);
+        return;
+    }
+
+    /* A literal builtin head needs no stack slot and no check */
+    bool direct = lval_type_of (o->cell[0]) == LVAL_FUN;
+
+    for (int i = direct ? 1 : 0; i < o->count; i++)
+        if (lval_is_quoted (o, i)) lcode_const (c, OP_CONST, o->cell[i]);
+        else lcode_expr (c, o->cell[i]);
+
+    if (direct)
+        lcode_emit (c, OP_CALL, lval_as_fun (o->cell[0]), o->count - 1, 2 - o->count);
+    else
+        lcode_emit (c, OP_APPLY, 0, o->count, 1 - o->count);
+}
+
+lcode *
+lcode_compile (lval v)
+{
+    lcode *c = calloc (1, sizeof (lcode));
+    lcode_expr (c, v);
+    lcode_emit (c, OP_RETURN, 0, 0, -1);
+    c->stack = malloc (sizeof (lval) * c->max_depth);
+    return c;
+}
+
+void
+lcode_free (lcode *c)
+{
+    for (int i = 0; i < c->nconsts; i++)
+        lval_del (c->consts[i]);
+
+    free (c->consts);
+    free (c->code);
+    free (c->stack);
+    free (c);
+}
+
+lval
+lcode_run (lenv *e, lcode *c)
+{
+    lval *sp = c->stack;
+
+    for (linsn *ip = c->code; ; ip++)
+    {
+        switch (ip->op)
+        {
+        case OP_CONST:
+        {
+            lval k = c->consts[ip->arg];
+            *sp++ = lval_is_obj (k) ? lval_copy (k) : k;
+            break;
+        }
+
+        case OP_GLOBAL:
+            *sp++ = lenv_get (e, c->consts[ip->arg]);
+            break;
+
+        case OP_CALL:
+        {
+            lval *args = sp - ip->arg;
+            lval result;
+
+            if (lval_has_err (args, ip->arg))
+                result = lval_first_err (args, ip->arg);
+            else
+            {
+                result = builtin_call (e, ip->fun, args, ip->arg);
+                for (int i = 0; i < ip->arg; i++)
+                    lval_del (args[i]);
+            }
+
+            sp = args;
+            *sp++ = result;
+            break;
+        }
+
+        case OP_APPLY:
+        {
+            lval *cells = sp - ip->arg;
+            lval result;
+
+            if (lval_has_err (cells, ip->arg))
+                result = lval_first_err (cells, ip->arg);
+            else if (ip->arg == 1 && lval_type_of (cells[0]) != LVAL_LAMBDA) result = cells[0];
+            else result = lval_call (e, cells[0], cells + 1, ip->arg - 1);
+
+            sp = cells;
+            *sp++ = result;
+            break;
+        }
+
+        case OP_EVAL:
+            *sp++ = lval_eval_in (e, NULL, c->consts[ip->arg]);
+            break;
+
+        case OP_RETURN:
+            return *--sp;
+        }
+    }
+}
+
+/*
+ * Closure compilation. Each sexpr becomes an lnode whose "run" function
+ * was picked for its operator, arity and which operands are literals,
+ * so running the tree again does no dispatching on the read structure.
+ *
+ * Arithmetic nodes start out generic and record the operand types they
+ * see. After LNODE_WARMUP runs a node that has only seen fixnums or only
+ * seen doubles quickens: its "run" is swapped for an int-only or
+ * double-only path (binary + - * with a literal int operand unboxed into
+ * "k"). A quickened node whose guard fails deoptimizes back to the
+ * generic path for good.
+ */
+typedef struct lnode lnode;
+
+typedef lval (*lnode_fn) (lnode *n, lenv *e);
+
+#define LNODE_WARMUP 16
+
+enum
+{
+    LNODE_SEEN_INT    = 1,
+    LNODE_SEEN_DOUBLE = 2,
+    LNODE_SEEN_OTHER  = 4
+};
+
+struct lnode
+{
+    lnode_fn run;
+    lbuiltin fun;
+    lval value;   // Constant nodes
+    long k;       // Unboxed literal operand
+    int runs;     // Generic runs of an arithmetic node, up to LNODE_WARMUP
+    int seen;     // LNODE_SEEN_* operand types, never cleared
+    int count;
+    lnode **kids;
+    lval *args;   // Scratch for evaluated kids, reused every run
+};
+
+lval
+lnode_const (lnode *n, lenv *e)
+{
+    (void) e;
+    return lval_is_obj (n->value) ? lval_copy (n->value) : n->value;
+}
+
+lval
+lnode_global (lnode *n, lenv *e) { return lenv_get (e, n->value); }
+
+lval
+lnode_call (lnode *n, lenv *e)
+{
+    for (int i = 0; i < n->count; i++)
+        n->args[i] = n->kids[i]->run (n->kids[i], e);
+
+    if (lval_has_err (n->args, n->count))
+        return lval_first_err (n->args, n->count);
+
+    lval result = builtin_call (e, n->fun, n->args, n->count);
+    for (int i = 0; i < n->count; i++)
+        lval_del (n->args[i]);
+    return result;
+}
+
+lval
+lnode_apply (lnode *n, lenv *e)
+{
+    for (int i = 0; i < n->count; i++)
+        n->args[i] = n->kids[i]->run (n->kids[i], e);
+
+    if (lval_has_err (n->args, n->count))
+        return lval_first_err (n->args, n->count);
+
+    if (n->count == 1 && lval_type_of (n->args[0]) != LVAL_LAMBDA) return n->args[0];
+    return lval_call (e, n->args[0], n->args + 1, n->count - 1);
+}
+
+/* Special forms, run by the evaluator on the read expression */
+lval
+lnode_eval (lnode *n, lenv *e) { return lval_eval_in (e, NULL, n->value); }
+
+lval
+lnode_arith (lnode *n, lenv *e);
+
+/* Records the types of the evaluated "args" in the node's feedback */
+static inline void
+lnode_observe (lnode *n)
+{
+    for (int i = 0; i < n->count; i++)
+        n->seen |= lval_is_fixnum (n->args[i]) ? LNODE_SEEN_INT
+                 : lval_is_double (n->args[i]) ? LNODE_SEEN_DOUBLE
+                 : LNODE_SEEN_OTHER;
+}
+
+/* Applies an arithmetic node generically to its evaluated "args" */
+lval
+lnode_arith_args (lnode *n)
 {
-    lval_type type;
-    long inum;
-    double dnum;
-    char *err;
-    char* sym;
-    int count; // For the length of lval list
-    struct lval **cell;
-} lval;
-
-lval *
-lval_int (long x)
+    if (lval_has_err (n->args, n->count))
+        return lval_first_err (n->args, n->count);
+
+    lval result = builtin_op (n->fun, n->args, n->count);
+    for (int i = 0; i < n->count; i++)
+        lval_del (n->args[i]);
+    return result;
+}
+
+/* A quickened node saw a type it wasn't specialized for */
+lval
+lnode_deopt (lnode *n)
 {
-    lval *v = malloc (sizeof (lval));
-    v->type = LVAL_INT;
-    v->inum = x;
-    return v;
+    lnode_observe (n);
+    n->run = lnode_arith;
+    return lnode_arith_args (n);
 }
 
-lval *
-lval_double (double x)
+/* Generic path for a binary node whose operands weren't both ints */
+lval
+lnode_slow2 (lnode *n, lval a, lval b)
 {
-    lval *v = malloc (sizeof (lval));
-    v->type = LVAL_DOUBLE;
-    v->dnum = x;
-    return v;
+    n->args[0] = a;
+    n->args[1] = b;
+    return lnode_deopt (n);
 }
 
-lval *
-lval_err (char *message)
+/* Ints that overflowed, which builtin_op widens without losing the quickening */
+lval
+lnode_wide2 (lnode *n, lval a, lval b)
 {
-    lval *v = malloc (sizeof (lval));
-    v->type = LVAL_ERR;
-    v->err = malloc (strlen (message) + 1);
-    strcpy (v->err, message);
-    return v;
+    n->args[0] = a;
+    n->args[1] = b;
+    return lnode_arith_args (n);
 }
 
-lval *
-lval_sym (char *sym)
+#define LNODE_BINARY(name, op)                                              \
+    lval                                                                    \
+    name (lnode *n, lenv *e)                                                \
+    {                                                                       \
+        lval a = n->kids[0]->run (n->kids[0], e);                              \
+        lval b = n->kids[1]->run (n->kids[1], e);                              \
+        long r;                                                             \
+        if (lval_is_fixnum (a) && lval_is_fixnum (b))                       \
+            return op (lval_as_int (a), lval_as_int (b), &r)                \
+                   ? lnode_wide2 (n, a, b) : lval_int (r);                  \
+        return lnode_slow2 (n, a, b);                                       \
+    }                                                                       \
+                                                                            \
+    lval                                                                    \
+    name##_rk (lnode *n, lenv *e)                                           \
+    {                                                                       \
+        lval a = n->kids[0]->run (n->kids[0], e);                              \
+        long r;                                                             \
+        if (lval_is_fixnum (a))                                             \
+            return op (lval_as_int (a), n->k, &r)                           \
+                   ? lnode_wide2 (n, a, n->kids[1]->value) : lval_int (r);  \
+        return lnode_slow2 (n, a, n->kids[1]->value);                       \
+    }                                                                       \
+                                                                            \
+    lval                                                                    \
+    name##_lk (lnode *n, lenv *e)                                           \
+    {                                                                       \
+        lval b = n->kids[1]->run (n->kids[1], e);                              \
+        long r;                                                             \
+        if (lval_is_fixnum (b))                                             \
+            return op (n->k, lval_as_int (b), &r)                           \
+                   ? lnode_wide2 (n, n->kids[0]->value, b) : lval_int (r);  \
+        return lnode_slow2 (n, n->kids[0]->value, b);                       \
+    }
+
+LNODE_BINARY (lnode_add2, __builtin_add_overflow)
+LNODE_BINARY (lnode_sub2, __builtin_sub_overflow)
+LNODE_BINARY (lnode_mul2, __builtin_mul_overflow)
+
+/* Specialized binary nodes, indexed by lbuiltin then literal shape */
+static const lnode_fn lnode_binary[BUILTIN_COUNT][3] =
 {
-    lval *v = malloc (sizeof (lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc (strlen (sym) + 1);
-    strcpy (v->sym, sym);
-    return v;
+    [BUILTIN_ADD] = { lnode_add2, lnode_add2_rk, lnode_add2_lk },
+    [BUILTIN_SUB] = { lnode_sub2, lnode_sub2_rk, lnode_sub2_lk },
+    [BUILTIN_MUL] = { lnode_mul2, lnode_mul2_rk, lnode_mul2_lk },
+};
+
+/* Any arity arithmetic on fixnums, as builtin_op does it */
+lval
+lnode_arith_int (lnode *n, lenv *e)
+{
+    for (int i = 0; i < n->count; i++)
+        n->args[i] = n->kids[i]->run (n->kids[i], e);
+
+    for (int i = 0; i < n->count; i++)
+        if (!lval_is_fixnum (n->args[i])) return lnode_deopt (n);
+
+    long x = lval_as_int (n->args[0]);
+    if (n->fun == BUILTIN_SUB && n->count == 1) x = -x;
+
+    for (int i = 1; i < n->count; i++)
+    {
+        long y = lval_as_int (n->args[i]);
+
+        /* Leave overflow, zero divisors and negative powers to builtin_op */
+        if ((y == 0 && (n->fun == BUILTIN_DIV || n->fun == BUILTIN_MOD))
+            || (y < 0 && n->fun == BUILTIN_POW) || !lint_op (n->fun, &x, y))
+            return lnode_arith_args (n);
+    }
+    return lval_int (x);
 }
 
-lval *
-lval_sexpr ()
+/* Any arity arithmetic on doubles, as builtin_op does it */
+lval
+lnode_arith_double (lnode *n, lenv *e)
 {
-    lval *v = malloc (sizeof (lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    for (int i = 0; i < n->count; i++)
+        n->args[i] = n->kids[i]->run (n->kids[i], e);
+
+    for (int i = 0; i < n->count; i++)
+        if (!lval_is_double (n->args[i])) return lnode_deopt (n);
+
+    double x = lval_as_double (n->args[0]);
+    if (n->fun == BUILTIN_SUB && n->count == 1) x = -x;
+
+    for (int i = 1; i < n->count; i++)
+    {
+        double y = lval_as_double (n->args[i]);
+
+        switch (n->fun)
+        {
+        case BUILTIN_ADD : x += y; break;
+        case BUILTIN_SUB : x -= y; break;
+        case BUILTIN_MUL : x *= y; break;
+        case BUILTIN_DIV :
+            if (y == 0) return lval_err ("Division By Zero");
+            x /= y;
+            break;
+        case BUILTIN_MOD :
+            if (y == 0) return lval_err ("Division By Zero");
+            x = fmod (x, y);
+            break;
+        case BUILTIN_POW : x = pow (x, y); break;
+        default          : break;
+        }
+    }
+    return lval_double (x);
 }
 
+/* Swaps a warmed up arithmetic node onto the path for the one type it has seen */
 void
-lval_del (lval *v)
+lnode_quicken (lnode *n)
 {
-    switch (v->type)
+    if (n->seen == LNODE_SEEN_DOUBLE)
     {
-    case LVAL_DOUBLE: break;
-    case LVAL_INT: break;
-    case LVAL_ERR: free (v->err); break;
-    case LVAL_SYM: free (v->sym); break;
-    case LVAL_SEXPR:
-        for (int i = 0; i < v->count; i++)
-            lval_del (v->cell[i]);
+        n->run = lnode_arith_double;
+        return;
+    }
+    if (n->seen != LNODE_SEEN_INT) return;
 
-        free (v->cell);
-        break;
+    n->run = lnode_arith_int;
+
+    if (n->count == 2 && lnode_binary[n->fun][0] != NULL)
+    {
+        bool lk = n->kids[0]->run == lnode_const;
+        bool rk = n->kids[1]->run == lnode_const;
+
+        if (rk && !lk)
+        {
+            n->k = lval_as_int (n->kids[1]->value);
+            n->run = lnode_binary[n->fun][1];
+        }
+        else if (lk && !rk)
+        {
+            n->k = lval_as_int (n->kids[0]->value);
+            n->run = lnode_binary[n->fun][2];
+        }
+        else n->run = lnode_binary[n->fun][0];
     }
-    free (v);
 }
-lval *
-lval_read_num (mpc_ast_t *t)
+
+lval
+lnode_arith (lnode *n, lenv *e)
 {
-    errno = 0;
+    for (int i = 0; i < n->count; i++)
+        n->args[i] = n->kids[i]->run (n->kids[i], e);
 
-    if (strstr (t->contents, "."))
+    if (n->runs < LNODE_WARMUP)
     {
-        double x = strtod (t->contents, NULL);
-        return errno != ERANGE ? lval_double (x) : lval_err ("Invalid floating point number");
+        lnode_observe (n);
+        if (++n->runs == LNODE_WARMUP) lnode_quicken (n);
     }
-    else
+    return lnode_arith_args (n);
+}
+
+/* A node that runs "run" on its own copy of "v" */
+lnode *
+lnode_value (lval v, lnode_fn run)
+{
+    lnode *n = calloc (1, sizeof (lnode));
+    n->run = run;
+    n->value = lval_copy (v);
+    return n;
+}
+
+lnode *
+lnode_compile (lval v)
+{
+    if (lval_type_of (v) == LVAL_SYM) return lnode_value (v, lnode_global);
+
+    lobj *o = lval_type_of (v) == LVAL_SEXPR ? lval_obj (v) : NULL;
+
+    /* Literals, and empty expressions which evaluate to themselves */
+    if (o == NULL || o->count == 0) return lnode_value (v, lnode_const);
+
+    if (lval_is_special (o)) return lnode_value (v, lnode_eval);
+
+    if (o->count == 1 && lval_type_of (o->cell[0]) != LVAL_SYM
+        && lval_type_of (o->cell[0]) != LVAL_SEXPR)
+        return lnode_compile (o->cell[0]);
+
+    lnode *n = calloc (1, sizeof (lnode));
+
+    /* A literal builtin head is bound now and left out of the kids */
+    bool direct = lval_type_of (o->cell[0]) == LVAL_FUN;
+    int first = direct ? 1 : 0;
+
+    n->count = o->count - first;
+    n->kids = malloc (sizeof (lnode *) * n->count);
+    n->args = malloc (sizeof (lval) * n->count);
+
+    for (int i = 0; i < n->count; i++)
+        n->kids[i] = lval_is_quoted (o, first + i)
+            ? lnode_value (o->cell[first + i], lnode_const)
+            : lnode_compile (o->cell[first + i]);
+
+    if (!direct)
     {
-        long x = strtol (t->contents, NULL, 10);
-        return errno != ERANGE ? lval_int (x) : lval_err ("Invalid integer");
+        n->run = lnode_apply;
+        return n;
     }
+
+    n->fun = lval_as_fun (o->cell[0]);
+    n->run = builtin_is_op (n->fun) && n->count > 0 ? lnode_arith : lnode_call;
+    return n;
 }
 
-lval *
-lval_add (lval *v, lval *x)
+void
+lnode_free (lnode *n)
 {
-    v->count++;
-    v->cell = realloc (v->cell, sizeof (lval*) * v->count);
-    v->cell[v->count - 1] = x;
-    return v;
+    for (int i = 0; i < n->count; i++)
+        lnode_free (n->kids[i]);
+
+    lval_del (n->value);
+    free (n->kids);
+    free (n->args);
+    free (n);
 }
 
-lval *
-lval_read (mpc_ast_t *t)
+/*
+ * Baseline JIT for arithmetic. An expression whose leaves are number
+ * literals, globals holding fixnums or doubles and let locals, and whose
+ * heads are literal builtins other than ^, has a type known up front
+ * (builtin_op stays integral until it meets a double), so it is compiled
+ * straight to x86-64: ints are kept in rax, doubles in xmm0, and pending
+ * accumulators and let values on the machine stack. Globals are read out
+ * of the lenv at the slot they had when compiling, which holds as nothing
+ * compiled can def, and are guarded on the type they had then. The code
+ * writes the unboxed result through its argument and returns 0, or
+ * returns 1 on a failed guard, a zero divisor or an integer overflow so
+ * the caller can rerun the expression in the interpreter. Only available
+ * on Linux x86-64.
+ */
+typedef struct ljit
 {
-    if (strstr (t->tag, "number")) return lval_read_num (t);
-    if (strstr (t->tag, "symbol")) return lval_sym (t->contents);
+    int (*fn) (void *out, lenv *e);
+    size_t size;
+    lval_type type;
+} ljit;
 
-    lval *x = NULL;
+#if defined (__x86_64__) && defined (__linux__)
 
-    if (strcmp (t->tag, ">") == 0) x = lval_sexpr ();
-    if (strstr (t->tag, "sexpr"))  x = lval_sexpr ();
+#include <sys/mman.h>
 
-    for (int i = 0; i< t->children_num; i++)
+/* The values of one let, stored from "base" words below the entry rsp */
+typedef struct llet
+{
+    int base;
+    int count;
+    lval_type *types;
+} llet;
+
+typedef struct lasm
+{
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    size_t *bails; // Offsets of rel32 jumps to the bail stub
+    int nbails;
+    int bailcap;
+    lenv *env;
+    int words;     // Pushed onto the machine stack so far
+    llet *lets;    // Innermost last
+    int nlets;
+} lasm;
+
+void
+lasm_bytes (lasm *a, const void *bytes, size_t n)
+{
+    if (a->len + n > a->cap)
     {
-        if (strcmp (t->children[i]->contents, " (") == 0) continue;
-        if (strcmp (t->children[i]->contents, ")") == 0) continue;
-        if (strcmp (t->children[i]->tag, "regex")  == 0) continue;
-        x = lval_add (x, lval_read (t->children[i]));
+        while (a->len + n > a->cap) a->cap = a->cap ? a->cap * 2 : 256;
+        a->buf = realloc (a->buf, a->cap);
     }
-
-    return x;
+    memcpy (a->buf + a->len, bytes, n);
+    a->len += n;
 }
 
+#define LASM(a, ...) lasm_bytes ((a), (const uint8_t[]) { __VA_ARGS__ }, \
+                                 sizeof ((const uint8_t[]) { __VA_ARGS__ }))
+
 void
-lval_print (lval *v);
+lasm_imm32 (lasm *a, int32_t imm) { lasm_bytes (a, &imm, sizeof (imm)); }
 
 void
-lval_expr_print (lval *v, char open, char close)
+lasm_imm64 (lasm *a, uint64_t imm)
 {
-    putchar (open);
+    LASM (a, 0x48, 0xB8);                      // mov rax, imm64
+    lasm_bytes (a, &imm, sizeof (imm));
+}
 
-    for (int i = 0; i < v->count; i++)
-    {
-        lval_print (v->cell[i]);
+/* Emits "opcode rel32" whose target is patched to the bail stub later */
+void
+lasm_bail_if (lasm *a, uint8_t jcc)
+{
+    LASM (a, 0x0F, jcc, 0, 0, 0, 0);
 
-        if (i != (v->count - 1)) putchar (' ');
+    if (a->nbails == a->bailcap)
+    {
+        a->bailcap = a->bailcap ? a->bailcap * 2 : 8;
+        a->bails = realloc (a->bails, sizeof (size_t) * a->bailcap);
     }
-    putchar (close);
+    a->bails[a->nbails++] = a->len;
 }
 
+/* Bails out when the double divisor in xmm1 is zero */
 void
-lval_print (lval *v)
+lasm_check_zero (lasm *a)
+{
+    LASM (a, 0x66, 0x0F, 0x57, 0xD2);          // xorpd xmm2, xmm2
+    LASM (a, 0x66, 0x0F, 0x2E, 0xCA);          // ucomisd xmm1, xmm2
+    LASM (a, 0x7A, 0x06);                      // jp over (NaN isn't zero)
+    lasm_bail_if (a, 0x84);                    // je bail
+}
+
+/*
+ * Combines the accumulator with the operand in rcx or xmm1 like builtin_op,
+ * returning the accumulator's new type or -1 if the step can't be compiled
+ */
+int
+lasm_op (lasm *a, lbuiltin op, lval_type acc, lval_type arg)
 {
-    switch (v->type)
+    if (acc == LVAL_INT && arg == LVAL_INT)
+    {
+        switch (op)
+        {
+        case BUILTIN_ADD : LASM (a, 0x48, 0x01, 0xC8); break;         // add rax, rcx
+        case BUILTIN_SUB : LASM (a, 0x48, 0x29, 0xC8); break;         // sub rax, rcx
+        case BUILTIN_MUL : LASM (a, 0x48, 0x0F, 0xAF, 0xC1); break;   // imul rax, rcx
+        case BUILTIN_DIV :
+        case BUILTIN_MOD :
+            LASM (a, 0x48, 0x85, 0xC9);                                // test rcx, rcx
+            lasm_bail_if (a, 0x84);                                    // jz bail
+            LASM (a, 0x48, 0x83, 0xF9, 0xFF);                          // cmp rcx, -1
+            lasm_bail_if (a, 0x84);                                    // je bail
+            LASM (a, 0x48, 0x99);                                      // cqo
+            LASM (a, 0x48, 0xF7, 0xF9);                                // idiv rcx
+            if (op == BUILTIN_MOD) LASM (a, 0x48, 0x89, 0xD0);         // mov rax, rdx
+            break;
+        default: break;
+        }
+
+        /* Overflow needs a bignum */
+        if (op != BUILTIN_DIV && op != BUILTIN_MOD) lasm_bail_if (a, 0x80);  // jo bail
+        return LVAL_INT;
+    }
+
+    /* Floating point % needs fmod */
+    if (op != BUILTIN_ADD && op != BUILTIN_SUB && op != BUILTIN_MUL && op != BUILTIN_DIV)
+        return -1;
+
+    if (arg == LVAL_INT) LASM (a, 0xF2, 0x48, 0x0F, 0x2A, 0xC9);     // cvtsi2sd xmm1, rcx
+    if (acc == LVAL_INT) LASM (a, 0xF2, 0x48, 0x0F, 0x2A, 0xC0);     // cvtsi2sd xmm0, rax
+    if (op == BUILTIN_DIV) lasm_check_zero (a);
+
+    switch (op)
     {
-    case LVAL_INT    : printf ("%li", v->inum); break;
-    case LVAL_DOUBLE : printf ("%lf", v->dnum); break;
-    case LVAL_ERR    : printf ("%s", v->err); break;
-    case LVAL_SYM    : printf ("%s", v->sym); break;
-    case LVAL_SEXPR  : lval_expr_print (v, '(', ')'); break;
+    case BUILTIN_ADD : LASM (a, 0xF2, 0x0F, 0x58, 0xC1); break;       // addsd xmm0, xmm1
+    case BUILTIN_SUB : LASM (a, 0xF2, 0x0F, 0x5C, 0xC1); break;       // subsd xmm0, xmm1
+    case BUILTIN_MUL : LASM (a, 0xF2, 0x0F, 0x59, 0xC1); break;       // mulsd xmm0, xmm1
+    case BUILTIN_DIV : LASM (a, 0xF2, 0x0F, 0x5E, 0xC1); break;       // divsd xmm0, xmm1
+    default: break;
     }
+    return LVAL_DOUBLE;
 }
 
+/* Pushes rax or xmm0 as one word */
 void
-lval_println (lval *v) { lval_print (v); putchar ('\n'); }
-lval *
+lasm_push (lasm *a, int type)
+{
+    if (type == LVAL_INT) LASM (a, 0x50);                              // push rax
+    else
+    {
+        LASM (a, 0x48, 0x83, 0xEC, 0x08);                              // sub rsp, 8
+        LASM (a, 0xF2, 0x0F, 0x11, 0x04, 0x24);                        // movsd [rsp], xmm0
+    }
+    a->words++;
+}
 
-lval_pop (lval *v, int i)
+/* Loads global "sym" from its lenv slot, bailing unless it still has the type it has now */
+int
+lasm_global (lasm *a, lval sym)
 {
-    /* Find the item at "i" */
-    lval *x = v->cell[i];
+    int i = lenv_slot (a->env, lval_as_atom (sym));
+    if (a->env->atoms[i] == -1) return -1;
 
-    /* Shift memory after the item at "i" over the top */
-    memmove (&v->cell[i],
-             &v->cell[i + 1],
-             sizeof (lval*) * (v->count -i -1));
+    lval v = a->env->vals[i];
+    int type = lval_type_of (v);
+    if (type != LVAL_DOUBLE && (type != LVAL_INT || lval_is_obj (v))) return -1;
 
-    /* Decrease the count of items in the list */
-    v->count--;
+    LASM (a, 0x48, 0x8B, 0x86);                                        // mov rax, [rsi + vals]
+    lasm_imm32 (a, offsetof (lenv, vals));
+    LASM (a, 0x48, 0x8B, 0x80);                                        // mov rax, [rax + slot]
+    lasm_imm32 (a, i * sizeof (lval));
 
-    /* Reallocate the memory used */
-    v->cell = realloc(v->cell, sizeof (lval*) * v->count);
-    return x;
+    LASM (a, 0x48, 0x89, 0xC2);                                        // mov rdx, rax
+    LASM (a, 0x48, 0xC1, 0xEA, 0x30);                                  // shr rdx, 48
+    LASM (a, 0x48, 0x81, 0xFA);                                        // cmp rdx, tag
+
+    if (type == LVAL_INT)
+    {
+        lasm_imm32 (a, LVAL_TAG_INT >> 48);
+        lasm_bail_if (a, 0x85);                                        // jne bail
+        LASM (a, 0x48, 0xC1, 0xE0, 0x10);                              // shl rax, 16
+        LASM (a, 0x48, 0xC1, 0xF8, 0x10);                              // sar rax, 16
+    }
+    else
+    {
+        /* Doubles are everything at or below the plain quiet NaN */
+        lasm_imm32 (a, LVAL_BOX >> 48);
+        lasm_bail_if (a, 0x87);                                        // ja bail
+        LASM (a, 0x66, 0x48, 0x0F, 0x6E, 0xC0);                        // movq xmm0, rax
+    }
+    return type;
 }
 
-lval *
-lval_take (lval *v, int i)
+/* Loads a let local from the machine stack, its type fixed when the let was compiled */
+int
+lasm_local (lasm *a, lval slot)
 {
-    lval *x = lval_pop (v, i);
-    lval_del (v);
-    return x;
+    int depth = lval_slot_depth (slot);
+    if (depth >= a->nlets) return -1;
+
+    llet *l = &a->lets[a->nlets - 1 - depth];
+    int i = lval_slot_index (slot);
+    int32_t at = -8 * (l->base + i + 1);
+
+    if (l->types[i] == LVAL_INT) LASM (a, 0x49, 0x8B, 0x80);           // mov rax, [r8 + at]
+    else LASM (a, 0xF2, 0x41, 0x0F, 0x10, 0x80);                       // movsd xmm0, [r8 + at]
+    lasm_imm32 (a, at);
+    return l->types[i];
 }
 
-lval *
-builtin_op (lval *a, char *op)
+int
+lasm_expr (lasm *a, lval v);
+
+/* Pushes each value of let "o" in turn, then runs its body and drops them */
+int
+lasm_let (lasm *a, lobj *o)
 {
+    lobj *bindings = lval_obj (o->cell[1]);
+    llet l = { a->words, bindings->count, malloc (sizeof (lval_type) * (bindings->count + 1)) };
 
-    /* Ensure all the arguments are numbers */
-    for (int i = 0; i < a->count; i++)
-        if (a->cell[i]->type != LVAL_INT
-            && a->cell[i]->type != LVAL_DOUBLE)
+    for (int i = 0; i < l.count; i++)
+    {
+        int type = lasm_expr (a, lval_let_value (o, i));
+        if (type < 0)
         {
-            lval_del(a);
-            return lval_err("Cannnot operate on non-number!");
+            free (l.types);
+            return -1;
         }
+        l.types[i] = type;
+        lasm_push (a, type);
+    }
 
-    /* Pop the first element */
-    lval *x = lval_pop (a, 0);
+    a->lets = realloc (a->lets, sizeof (llet) * (a->nlets + 1));
+    a->lets[a->nlets++] = l;
+    int type = lasm_expr (a, o->cell[2]);
+    a->nlets--;
+    free (l.types);
 
-    /* If no arguments and sub then preform unary negation */
-    if ((strcmp (op, "-") == 0) && a->count == 0)
+    if (l.count > 0)
     {
-        if (x->type == LVAL_INT) x->inum = -x->inum;
-        else x->dnum = -x->dnum;
+        LASM (a, 0x48, 0x81, 0xC4);                                    // add rsp, 8 * count
+        lasm_imm32 (a, 8 * l.count);
+        a->words -= l.count;
     }
+    return type;
+}
 
-    /* White there are still elements remaining */
-    while (a->count > 0)
+/* Emits code leaving "v" in rax or xmm0, returning its type or -1 if it can't be compiled */
+int
+lasm_expr (lasm *a, lval v)
+{
+    switch (lval_type_of (v))
     {
-        /* Pop the next element */
-        lval *y = lval_pop (a, 0);
+    case LVAL_INT:
+        lasm_imm64 (a, (uint64_t) lval_as_int (v));
+        return LVAL_INT;
+
+    case LVAL_DOUBLE:
+        lasm_imm64 (a, v);
+        LASM (a, 0x66, 0x48, 0x0F, 0x6E, 0xC0);                        // movq xmm0, rax
+        return LVAL_DOUBLE;
+
+    case LVAL_SYM: return lasm_global (a, v);
+    case LVAL_SLOT: return lasm_local (a, v);
+    case LVAL_SEXPR: break;
+    default: return -1;
+    }
+
+    lobj *o = lval_obj (v);
+
+    if (lval_is_let (o)) return lasm_let (a, o);
+    if (o->count == 1) return lasm_expr (a, o->cell[0]);
+    if (o->count == 0 || lval_type_of (o->cell[0]) != LVAL_FUN) return -1;
+
+    lbuiltin op = lval_as_fun (o->cell[0]);
+    if (!builtin_is_op (op) || op == BUILTIN_POW) return -1;
 
-        if ((x->type == LVAL_INT) && (y->type == LVAL_INT))
+    int acc = lasm_expr (a, o->cell[1]);
+    if (acc < 0) return -1;
+
+    /* Unary negation */
+    if (op == BUILTIN_SUB && o->count == 2)
+    {
+        if (acc == LVAL_INT)
         {
-            if (strcmp (op, "+") == 0) (x->inum += y->inum);
-            if (strcmp (op, "-") == 0) (x->inum -= y->inum);
-            if (strcmp (op, "*") == 0) (x->inum *= y->inum);
-            if (strcmp (op, "%") == 0) (x->inum %= y->inum);
-            if (strcmp (op, "^") == 0) (x->inum = pow(x->inum, y->inum));
-            if (strcmp (op, "/") == 0)
-            {
-                if (y->inum == 0)
-                {
-                    lval_del (x);
-                    lval_del (y);
-                    x = lval_err ("Division By Zero");
-                }
-            }
+            LASM (a, 0x48, 0xF7, 0xD8);                                // neg rax
+            lasm_bail_if (a, 0x80);                                    // jo bail
         }
-
-        if ((x->type == LVAL_DOUBLE) && (y->type == LVAL_INT))
+        else
         {
-            if (strcmp (op, "+") == 0) (x->dnum += y->inum);
-            if (strcmp (op, "-") == 0) (x->dnum -= y->inum);
-            if (strcmp (op, "*") == 0) (x->dnum *= y->inum);
-            if (strcmp (op, "/") == 0)
-            {
-                if (y->inum == 0)
-                {
-                    lval_del (x);
-                    lval_del (y);
-                    x = lval_err ("Division By Zero");
-                }
-            }
+            LASM (a, 0x48, 0xBA, 0, 0, 0, 0, 0, 0, 0, 0x80);           // mov rdx, sign bit
+            LASM (a, 0x66, 0x48, 0x0F, 0x6E, 0xCA);                    // movq xmm1, rdx
+            LASM (a, 0x66, 0x0F, 0x57, 0xC1);                          // xorpd xmm0, xmm1
         }
+    }
+
+    for (int i = 2; i < o->count; i++)
+    {
+        /* Save the accumulator while the next operand is computed */
+        lasm_push (a, acc);
+
+        int arg = lasm_expr (a, o->cell[i]);
+        if (arg < 0) return -1;
 
-        if ((x->type == LVAL_INT) && (y->type == LVAL_DOUBLE))
+        if (arg == LVAL_INT) LASM (a, 0x48, 0x89, 0xC1);               // mov rcx, rax
+        else LASM (a, 0x66, 0x0F, 0x28, 0xC8);                         // movapd xmm1, xmm0
+
+        if (acc == LVAL_INT) LASM (a, 0x58);                           // pop rax
+        else
         {
-            if (strcmp (op, "+") == 0) (x->inum += y->dnum);
-            if (strcmp (op, "-") == 0) (x->inum -= y->dnum);
-            if (strcmp (op, "*") == 0) (x->inum *= y->dnum);
-            if (strcmp (op, "/") == 0)
-            {
-                if (y->dnum == 0)
-                {
-                    lval_del (x);
-                    lval_del (y);
-                    x = lval_err ("Division By Zero");
-                }
-            }
+            LASM (a, 0xF2, 0x0F, 0x10, 0x04, 0x24);                    // movsd xmm0, [rsp]
+            LASM (a, 0x48, 0x83, 0xC4, 0x08);                          // add rsp, 8
         }
+        a->words--;
+
+        acc = lasm_op (a, op, acc, arg);
+        if (acc < 0) return -1;
+    }
+    return acc;
+}
+
+/* Compiles "v" against the globals in "e", which must not be redefined before it runs */
+ljit *
+ljit_compile (lenv *e, lval v)
+{
+    lasm a = { .env = e };
+
+    LASM (&a, 0x49, 0x89, 0xE0);                                       // mov r8, rsp
+    int type = lasm_expr (&a, v);
+    free (a.lets);
+
+    if (type < 0)
+    {
+        free (a.buf);
+        free (a.bails);
+        return NULL;
+    }
+
+    if (type == LVAL_INT) LASM (&a, 0x48, 0x89, 0x07);                 // mov [rdi], rax
+    else LASM (&a, 0xF2, 0x0F, 0x11, 0x07);                            // movsd [rdi], xmm0
+    LASM (&a, 0x31, 0xC0, 0xC3);                                       // xor eax, eax; ret
+
+    /* Bail stub: drop anything still pushed and report failure */
+    for (int i = 0; i < a.nbails; i++)
+    {
+        int32_t rel = (int32_t) (a.len - a.bails[i]);
+        memcpy (a.buf + a.bails[i] - 4, &rel, 4);
+    }
+    LASM (&a, 0x4C, 0x89, 0xC4);                                       // mov rsp, r8
+    LASM (&a, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3);                     // mov eax, 1; ret
+
+    void *mem = mmap (NULL, a.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        free (a.buf);
+        free (a.bails);
+        return NULL;
+    }
+    memcpy (mem, a.buf, a.len);
+    mprotect (mem, a.len, PROT_READ | PROT_EXEC);
+
+    ljit *j = malloc (sizeof (ljit));
+    j->fn = (int (*) (void *, lenv *)) mem;
+    j->size = a.len;
+    j->type = type;
+
+    free (a.buf);
+    free (a.bails);
+    return j;
+}
+
+void
+ljit_free (ljit *j)
+{
+    munmap ((void *) j->fn, j->size);
+    free (j);
+}
+
+#else
+
+ljit *
+ljit_compile (lenv *e, lval v) { (void) e; (void) v; return NULL; }
 
-        if ((x->type == LVAL_DOUBLE) && (y->type == LVAL_DOUBLE))
+void
+ljit_free (ljit *j) { (void) j; }
+
+#endif
+
+/* Runs compiled code, returning false if it bailed and the interpreter has to take over */
+static inline bool
+ljit_run (ljit *j, lenv *e, lval *result)
+{
+    union { long inum; double dnum; } out;
+
+    if (j->fn (&out, e) != 0) return false;
+
+    *result = j->type == LVAL_INT ? lval_int (out.inum) : lval_double (out.dnum);
+    return true;
+}
+
+typedef enum
+{
+    EVAL_TREE,    // Walk the lval tree, consuming it as it goes
+    EVAL_VM,      // Compile to bytecode once and run that
+    EVAL_CLOSURE, // Compile to a tree of specialized closures and run that
+    EVAL_JIT,     // Compile arithmetic to machine code, closures for the rest
+    EVAL_COUNT
+} leval_mode;
+
+static const char *eval_names[EVAL_COUNT] =
+{
+    [EVAL_TREE]    = "tree",
+    [EVAL_VM]      = "vm",
+    [EVAL_CLOSURE] = "closure",
+    [EVAL_JIT]     = "jit",
+};
+
+/* Evaluates the read expression "x" "repeat" times, returning the last result */
+lval
+lval_run (lenv *e, lval x, leval_mode mode, long repeat)
+{
+    lcode *c = mode == EVAL_VM ? lcode_compile (x) : NULL;
+    lnode *n = mode == EVAL_CLOSURE || mode == EVAL_JIT ? lnode_compile (x) : NULL;
+    ljit *j = mode == EVAL_JIT ? ljit_compile (e, x) : NULL;
+
+    /* Every result but the last is thrown away along with whatever it allocated */
+    lmark mark = larena_mark (lval_arena);
+    lval result = 0;
+
+    for (long i = 0; i < repeat; i++)
+    {
+        if (i > 0)
         {
-            if (strcmp (op, "+") == 0) (x->dnum += y->dnum);
-            if (strcmp (op, "-") == 0) (x->dnum -= y->dnum);
-            if (strcmp (op, "*") == 0) (x->dnum *= y->dnum);
-            if (strcmp (op, "/") == 0)
-            {
-                if (y->dnum == 0)
-                {
-                    lval_del (x);
-                    lval_del (y);
-                    x = lval_err ("Division By Zero");
-                }
-            }
+            lval_del (result);
+            larena_rewind (lval_arena, mark);
         }
 
-        lval_del (y);
+        /* Compiled code bails to the closures when it hits an error */
+        if (j != NULL && ljit_run (j, e, &result)) continue;
+
+        if (c != NULL) result = lcode_run (e, c);
+        else if (n != NULL) result = n->run (n, e);
+        else result = lval_eval (e, i + 1 < repeat ? lval_copy (x) : x);
     }
 
-    lval_del (a);
-    return x;
+    if (c != NULL) lcode_free (c);
+    if (n != NULL) lnode_free (n);
+    if (j != NULL) ljit_free (j);
+    if (mode != EVAL_TREE) lval_del (x);
+    return result;
 }
 
-lval *
-lval_eval_sexpr (lval *v);
+static double
+lmat_seconds (void)
+{
+    struct timespec ts;
+    timespec_get (&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-lval *
-lval_eval (lval *v)
+static void
+lmat_bench_report (const char *name, int n, double seconds, const double *c, const double *want)
 {
-    /* Evaluate Sexpressions */
-    if (v->type == LVAL_SEXPR) return lval_eval_sexpr (v);
+    double err = 0;
+    for (size_t i = 0; want != NULL && i < (size_t) n * n; i++)
+        if (fabs (c[i] - want[i]) > err) err = fabs (c[i] - want[i]);
 
-    /* All other values remain the same */
-    return v;
+    printf ("%-20s %10.1f ms %8.2f GFLOP/s", name, seconds * 1e3, 2.0 * n * n * n / seconds * 1e-9);
+    if (want != NULL) printf ("   max difference %g", err);
+    putchar ('\n');
 }
 
-lval *
-lval_eval_sexpr (lval *v)
+/* --bench-matmul n: the textbook triple loop against lmat_gemm, on one thread and on all of them */
+void
+lmat_bench (int n)
 {
-    /* Evaluate Children */
-    for (int i = 0; i < v->count; i++)
-        v->cell[i] = lval_eval (v->cell[i]);
+    size_t size = sizeof (double) * n * n;
+    double *a = malloc (size);
+    double *b = malloc (size);
+    double *want = malloc (size);
+    double *c = malloc (size);
 
-    /* Error Checking */
-    for (int i = 0; i < v->count; i++)
-        if (v->cell[i]->type == LVAL_ERR)
-            return lval_take (v, i);
+    srand (1);
+    for (size_t i = 0; i < (size_t) n * n; i++)
+    {
+        a[i] = (double) rand () / RAND_MAX - 0.5;
+        b[i] = (double) rand () / RAND_MAX - 0.5;
+    }
 
-    /* Empty Expression */
-    if (v->count == 0) return v;
+    double start = lmat_seconds ();
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+        {
+            double sum = 0;
+            for (int p = 0; p < n; p++) sum += a[(size_t) i * n + p] * b[(size_t) p * n + j];
+            want[(size_t) i * n + j] = sum;
+        }
+    lmat_bench_report ("naive", n, lmat_seconds () - start, want, NULL);
 
-    /* Single Expression */
-    if (v->count == 1) return lval_take (v, 0);
+    lmat_job g = { a, b, c, n, n, n };
+    memset (c, 0, size);
+    start = lmat_seconds ();
+    lmat_gemm_part (&g, 0, 1);
+    lmat_bench_report ("blocked, 1 thread", n, lmat_seconds () - start, c, want);
 
-    /* Ensure First Element is Symbol */
-    lval *f = lval_pop (v, 0);
-    if (f->type != LVAL_SYM)
+    if (lworkers_size () > 1)
     {
-        lval_del (f);
-        lval_del (v);
-        return lval_err("S-expression Does not start with symbol!");
+        char name[32];
+        snprintf (name, sizeof (name), "blocked, %i threads", lworkers_size ());
+        start = lmat_seconds ();
+        lmat_gemm (a, b, c, n, n, n);
+        lmat_bench_report (name, n, lmat_seconds () - start, c, want);
     }
 
-    /* Call Builtin with Operator */
-    lval *result = builtin_op (v, f->sym);
-    lval_del(f);
-    return result;
+    free (a);
+    free (b);
+    free (want);
+    free (c);
+}
+
+void
+usage (char *prog)
+{
+    fprintf (stderr, "usage: %s [--eval tree|vm|closure|jit] [--repeat n] [--no-fold] [--reclaim-budget n] [--bench-matmul n]\n", prog);
+    exit (1);
 }
 
 int
-main (void)
+main (int argc, char **argv)
 {
+    leval_mode mode = EVAL_TREE;
+    long repeat = 1;
+    bool fold = true;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp (argv[i], "--eval") == 0 && i + 1 < argc)
+        {
+            for (mode = 0; mode < EVAL_COUNT; mode++)
+                if (strcmp (argv[i + 1], eval_names[mode]) == 0) break;
+
+            if (mode == EVAL_COUNT) usage (argv[0]);
+            i++;
+        }
+        else if (strcmp (argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            repeat = strtol (argv[++i], NULL, 10);
+            if (repeat < 1) usage (argv[0]);
+        }
+        else if (strcmp (argv[i], "--no-fold") == 0) fold = false;
+        else if (strcmp (argv[i], "--reclaim-budget") == 0 && i + 1 < argc)
+        {
+            lval_reclaim_budget = strtol (argv[++i], NULL, 10);
+            if (lval_reclaim_budget < 1) usage (argv[0]);
+        }
+        else if (strcmp (argv[i], "--bench-matmul") == 0 && i + 1 < argc)
+        {
+            long n = strtol (argv[++i], NULL, 10);
+            if (n < 1 || n > 16384) usage (argv[0]);
+
+            lvec_init ();
+            lmat_bench (n);
+            return 0;
+        }
+        else usage (argv[0]);
+    }
+
     puts ("Lispy Version 0.0.1\n");
     puts ("Press Ctrl+c to Exit\n");
 
+    latom_init ();
+    lvec_init ();
+
     mpc_parser_t *Number = mpc_new ("number");
     mpc_parser_t *Symbol = mpc_new ("symbol");
+    mpc_parser_t *Vector = mpc_new ("vector");
     mpc_parser_t *Sexpr  = mpc_new ("sexpr");
     mpc_parser_t *Expr   = mpc_new ("expr");
     mpc_parser_t *Lispy  = mpc_new ("lispy");
@@ -389,30 +5528,53 @@ main (void)
     mpca_lang (MPCA_LANG_DEFAULT,
               "\
               number : /-?[0-9]+(\\.?[0-9]*)/ ;                       \
-              symbol : '+' | '-' | '*' | '/' | '%' | '^' ;            \
+              symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^]+/ ;          \
+              vector : '[' <number>* ']' ;                            \
               sexpr  : '(' <expr>* ')' ;                              \
-              expr   : <number> | <symbol> | <sexpr> ;                \
+              expr   : <number> | <symbol> | <vector> | <sexpr> ;     \
               lispy  : /^/ <expr>+ /$/ ;                              \
               ",
               Number,
               Symbol,
+              Vector,
               Sexpr,
               Expr,
               Lispy
     );
 
+    /* Global bindings */
+    lenv *e = lenv_new ();
+
+    /* Everything one line allocates lives here until it has been printed */
+    larena arena = { 0 };
+
     while (FOREVER)
     {
         char *input = readline ("> ");
+
+        /* End of input */
+        if (input == NULL) break;
+
         add_history (input);
 
         mpc_result_t r;
 
         if (mpc_parse ("<stdin>", input, Lispy, &r))
         {
-            lval *x = lval_eval (lval_read (r.output));
+            lval_arena = &arena;
+
+            lval x = lval_read (r.output);
+            mpc_ast_delete (r.output);
+
+            if (fold) x = lval_fold (x);
+            x = lval_resolve (x);
+
+            x = lval_run (e, x, mode, repeat);
             lval_println (x);
-            lval_del (x);
+            lval_del_later (x);
+
+            lval_arena = NULL;
+            larena_reset (&arena);
         }
         else
         {
@@ -423,5 +5585,12 @@ main (void)
         free (input);
     }
 
-    mpc_cleanup (5, Number, Symbol, Sexpr, Expr, Lispy);
+    lenv_del (e);
+    lreclaim_drain ();
+    larena_free (&arena);
+#ifdef LISPY_POOL_STATS
+    lpool_print_stats ();
+#endif
+    latom_cleanup ();
+    mpc_cleanup (6, Number, Symbol, Vector, Sexpr, Expr, Lispy);
 }